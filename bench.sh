@@ -0,0 +1,46 @@
+#!/bin/bash
+# Compares checks emitted as trap branches against checks emitted as
+# widenable guards that GuardWidening and LoopPredication may merge and hoist.
+# Each variant is optimized with -O2; the number of conditional branches into
+# the trap block that survive and the run time are reported. On the tests both
+# forms keep the same branches. bench/widenable_loop.c has a loop with an
+# early exit, where GuardWidening merges its two checks into one branch.
+PLUGIN_PATH="vaporeonpass/VaporeonPass.so"
+TEST_DIR="tests"
+BENCH_DIR="bench"
+TRAP_PASSES="vaporeonpass"
+WIDENABLE_PASSES="vaporeonpass<widenable-guards>,function(mem2reg,instcombine,guard-widening,loop-mssa(loop-predication),lower-widenable-condition)"
+
+if [ ! -f "$PLUGIN_PATH" ]; then
+    echo "Error: LLVM pass plugin not found at $PLUGIN_PATH"
+    exit 1
+fi
+
+mkdir -p "$BENCH_DIR"
+
+if [ -z "$1" ]; then
+    set -- "$TEST_DIR/stress_writes.c" "$TEST_DIR/simple_manual_strcpy.c" "$TEST_DIR/simple_inline_strcpy.c" "$BENCH_DIR/widenable_loop.c"
+fi
+
+printf "%-24s %-10s %8s %10s\n" "test" "checks" "branches" "seconds"
+for c_file in "$@"; do
+    base_name=$(basename -- "$c_file" .c)
+
+    clang -emit-llvm -S "$c_file" -Xclang -disable-O0-optnone -o "$BENCH_DIR/$base_name.ll"
+
+    for variant in trap widenable; do
+        if [ "$variant" = trap ]; then
+            passes="$TRAP_PASSES"
+        else
+            passes="$WIDENABLE_PASSES"
+        fi
+        out="$BENCH_DIR/$base_name.$variant"
+        opt -S -load-pass-plugin="$PLUGIN_PATH" -passes="$passes" "$BENCH_DIR/$base_name.ll" -o "$out.ll" > /dev/null 2>&1
+        opt -S -O2 "$out.ll" -o "$out.O2.ll"
+        clang -O2 "$out.O2.ll" -o "$out"
+        branches=$(grep -c "label %helpimtrappedandcantgetout" "$out.O2.ll")
+        # the strcpy tests copy argv[1]; a short string keeps them in bounds
+        seconds=$( { TIMEFORMAT=%R; time "$out" hello > /dev/null 2>&1; } 2>&1 )
+        printf "%-24s %-10s %8s %10s\n" "$base_name" "$variant" "$branches" "$seconds"
+    done
+done
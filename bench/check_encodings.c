@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <x86intrin.h>
+
+// Four stores per iteration at hashed indices through a pointer parameter, so
+// the bounds are only known at runtime and no check can be proven, hoisted or
+// strength-reduced.
+#define ITERATIONS 10000000
+#define STORES_PER_ITERATION 4
+#define REPEATS 5
+
+__attribute__((noinline)) void kernel(unsigned char *buffer, unsigned mask,
+                                      unsigned n) {
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned h = i * 2654435761u;
+        buffer[h & mask] = i;
+        buffer[(h >> 7) & mask] = i;
+        buffer[(h >> 14) & mask] = i;
+        buffer[(h >> 19) & mask] = i;
+    }
+}
+
+int main(void) {
+    unsigned char buffer[4096];
+    volatile unsigned mask = 4095;
+    volatile unsigned sink;
+    unsigned long long best = ~0ULL;
+
+    for (int r = 0; r < REPEATS; ++r) {
+        unsigned long long start = __rdtsc();
+        kernel(buffer, mask, ITERATIONS);
+        unsigned long long cycles = __rdtsc() - start;
+        if (cycles < best)
+            best = cycles;
+    }
+
+    // keep the stores alive
+    unsigned sum = 0;
+    for (int i = 0; i < 4096; ++i)
+        sum += buffer[i];
+    sink = sum;
+
+    printf("%.3f cycles per store\n",
+           (double)best / ((double)ITERATIONS * STORES_PER_ITERATION));
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+
+// Two checked stores per iteration through different buffers, in a loop that
+// may also exit early, so its trip count is unknown and the pass can neither
+// hoist nor version the checks. GuardWidening merges them into one branch.
+#define SIZE 4096
+#define REPEATS 20000
+
+__attribute__((noinline)) int fill(char* buffer, char* copy, int n, int stop) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        buffer[i] = 1;
+        copy[i] = 2;
+        if (i == stop)
+            break;
+    }
+    return i;
+}
+
+int main() {
+    char buffer[SIZE], copy[SIZE];
+    long total = 0;
+    for (int r = 0; r < REPEATS; ++r)
+        total += fill(buffer, copy, SIZE, SIZE);
+    printf("%ld\n", total);
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Measures each check encoding on bench/check_encodings.c, whose kernel makes
+# four checked stores per iteration. The kernel is timed with rdtsc (x86-64
+# only) against an uninstrumented build, and the difference is reported as
+# cycles per check along with the extra kernel code bytes per check, after -O2.
+PLUGIN_PATH="vaporeonpass/VaporeonPass.so"
+SOURCE="bench/check_encodings.c"
+BENCH_DIR="bench"
+ENCODINGS="fused split end overflow"
+
+if [ ! -f "$PLUGIN_PATH" ]; then
+    echo "Error: LLVM pass plugin not found at $PLUGIN_PATH"
+    exit 1
+fi
+
+mkdir -p "$BENCH_DIR"
+
+clang -emit-llvm -S "$SOURCE" -Xclang -disable-O0-optnone -o "$BENCH_DIR/check_encodings.ll"
+
+# prints "<cycles per store> <kernel bytes>" for the binary $1
+measure() {
+    cycles=$("$1" | awk '{ print $1 }')
+    size=$(nm -S "$1" | awk '$4 == "kernel" { print $2 }')
+    echo "$cycles $((16#$size))"
+}
+
+out="$BENCH_DIR/check_encodings.none"
+opt -S -O2 "$BENCH_DIR/check_encodings.ll" -o "$out.O2.ll"
+clang -O2 "$out.O2.ll" -o "$out"
+read -r base_cycles base_bytes <<< "$(measure "$out")"
+
+printf "%-10s %6s %16s %15s\n" "encoding" "checks" "cycles/check" "bytes/check"
+for encoding in $ENCODINGS; do
+    out="$BENCH_DIR/check_encodings.$encoding"
+    opt -S -load-pass-plugin="$PLUGIN_PATH" -passes="vaporeonpass<check-encoding=$encoding>" "$BENCH_DIR/check_encodings.ll" -o "$out.ll" > /dev/null 2>&1
+    opt -S -O2 "$out.ll" -o "$out.O2.ll"
+    clang -O2 "$out.O2.ll" -o "$out"
+    checks=$(grep -o "@__vaporeon_sites = private constant \[[0-9]*" "$out.ll" | grep -o "[0-9]*$")
+    read -r cycles bytes <<< "$(measure "$out")"
+    awk -v e="$encoding" -v n="$checks" -v c="$cycles" -v b="$bytes" \
+        -v bc="$base_cycles" -v bb="$base_bytes" \
+        'BEGIN { printf "%-10s %6d %16.3f %15.1f\n", e, n, c - bc, (b - bb) / n }'
+done
@@ -15,12 +15,13 @@ fi
 if [ -z "$1" ]; then
     for c_file in "$TEST_DIR"/*.c; do
         base_name=$(basename -- "$c_file" .c)
+        passes=$(sed -n 's|^// passes: ||p' "$c_file")
 
         echo "RUNNING TEST $base_name"
 
         clang -emit-llvm -S "$c_file" -Xclang -disable-O0-optnone -o "$TEST_DIR/$base_name.ll"
 
-        opt -load-pass-plugin="$PLUGIN_PATH" -passes="vaporeonpass" "$TEST_DIR/$base_name.ll" -o "$TEST_DIR/$base_name.vaporeon.ll" > "$TEST_DIR/${base_name}_output.txt"
+        opt -load-pass-plugin="$PLUGIN_PATH" -passes="${passes:-vaporeonpass}" "$TEST_DIR/$base_name.ll" -o "$TEST_DIR/$base_name.vaporeon.ll" > "$TEST_DIR/${base_name}_output.txt"
         clang "$TEST_DIR/$base_name.ll" -o $base_name
         clang "$TEST_DIR/$base_name.vaporeon.ll" -o $base_name.vaporeon
 
@@ -29,12 +30,13 @@ if [ -z "$1" ]; then
 else
     for c_file in "$@"; do
         base_name=$(basename -- "$c_file" .c)
+        passes=$(sed -n 's|^// passes: ||p' "$c_file")
 
         echo "RUNNING TEST $base_name"
 
         clang -emit-llvm -S "$c_file" -Xclang -disable-O0-optnone -o "$TEST_DIR/$base_name.ll"
 
-        opt -S -load-pass-plugin="$PLUGIN_PATH" -passes="vaporeonpass" "$TEST_DIR/$base_name.ll" -o "$TEST_DIR/$base_name.vaporeon.ll" > "$TEST_DIR/${base_name}_output.txt"
+        opt -S -load-pass-plugin="$PLUGIN_PATH" -passes="${passes:-vaporeonpass}" "$TEST_DIR/$base_name.ll" -o "$TEST_DIR/$base_name.vaporeon.ll" > "$TEST_DIR/${base_name}_output.txt"
         clang "$TEST_DIR/$base_name.ll" -o $base_name
         clang "$TEST_DIR/$base_name.vaporeon.ll" -o $base_name.vaporeon
 
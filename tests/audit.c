@@ -0,0 +1,16 @@
+// passes: vaporeonpass<audit>
+#include <stdio.h>
+
+struct vaporeon_site { const char *function, *file; unsigned line, column; };
+
+void __vaporeon_report(const struct vaporeon_site *site) {
+    fprintf(stderr, "out of bounds in %s()\n", site->function);
+}
+
+int main() {
+    char spare[16];
+    char buffer[16];
+    volatile int index = 16;
+    buffer[index] = 'A';
+    fputs("continued\n", stderr);
+}
@@ -0,0 +1,13 @@
+// passes: function(mem2reg),vaporeonpass
+
+int main() {
+    char buffer[4];
+    volatile int pick = 1;
+    char *p;
+    if (pick)
+        p = buffer + 2;
+    else
+        p = buffer;
+    volatile int index = 3;
+    p[index] = 'A';
+}
@@ -0,0 +1,9 @@
+// passes: vaporeonpass<budget=2>
+
+int main() {
+    char buffer[16];
+    for (int i = 0; i < 16; ++i)
+        buffer[i] = 'A';
+    volatile int index = 16;
+    buffer[index] = 'B';
+}
@@ -0,0 +1,7 @@
+// passes: vaporeonpass<check-encoding=overflow>
+
+int main() {
+    char buffer[16];
+    volatile int index = 13;
+    *(int *)(buffer + index) = 1;
+}
@@ -0,0 +1,9 @@
+// passes: vaporeonpass<no-static-checks;check-motion>
+
+int main() {
+    char buffer[4];
+    buffer[1] = 'a';
+    buffer[5] = 'b';
+    buffer[6] = 'c';
+    buffer[7] = 'd';
+}
@@ -0,0 +1,10 @@
+// passes: function(mem2reg),vaporeonpass<coalesce;no-dominated-checks>
+
+int main() {
+    char buffer[8];
+    volatile int start = 6;
+    char *p = buffer + start;
+    p[0] = 'a';
+    p[1] = 'b';
+    p[2] = 'c';
+}
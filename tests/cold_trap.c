@@ -0,0 +1,5 @@
+int main() {
+    char buffer[16];
+    for (int i = 0; i <= 16; ++i)
+        buffer[i] = 'A';
+}
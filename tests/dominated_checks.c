@@ -0,0 +1,10 @@
+// passes: function(mem2reg),vaporeonpass
+
+int main() {
+    char buffer[8];
+    volatile int index = 5;
+    char *p = buffer + index;
+    p[0] = 'a';
+    p[3] = 'd';
+    p[1] = 'b';
+}
@@ -0,0 +1,9 @@
+void put(char *p, int index) {
+    p[index] = 'A';
+}
+
+int main() {
+    char buffer[16];
+    for (int i = 0; i <= 16; ++i)
+        put(buffer, i);
+}
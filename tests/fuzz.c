@@ -0,0 +1,17 @@
+// passes: vaporeonpass<fuzz>
+#include <stddef.h>
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char buffer[8];
+    for (size_t i = 0; i < size; ++i)
+        buffer[i] = data[i];
+    return 0;
+}
+
+static const uint8_t input[16] = "fuzzfuzzfuzzfuzz";
+
+// stands in for libFuzzer, which passes a crashing input like this one
+int main() {
+    LLVMFuzzerTestOneInput(input, sizeof input);
+}
@@ -0,0 +1,7 @@
+// passes: vaporeonpass<guard-pages=4096>
+
+int main() {
+    char buffer[8192];
+    for (int i = 0; i <= 8192; ++i)
+        buffer[i] = 'A';
+}
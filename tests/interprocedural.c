@@ -0,0 +1,12 @@
+// passes: function(mem2reg),vaporeonpass<interprocedural>
+
+void fill(char *d, int n) {
+    for (int i = 0; i < n; ++i)
+        d[i] = 'A';
+}
+
+int main() {
+    char buffer[16];
+    volatile int count = 20;
+    fill(buffer, count);
+}
@@ -0,0 +1,10 @@
+void put(char *p, int index) {
+    if (index >= 0)
+        p[index] = 'A';
+}
+
+int main() {
+    char buffer[8];
+    put(buffer, -1);
+    put(buffer, 8);
+}
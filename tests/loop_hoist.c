@@ -0,0 +1,7 @@
+// passes: function(mem2reg),vaporeonpass<loop-hoist>
+
+int main() {
+    char buffer[16];
+    for (int i = 0; i < 20; ++i)
+        buffer[i] = 'A';
+}
@@ -0,0 +1,9 @@
+// passes: function(mem2reg,loop-simplify),vaporeonpass<loop-version>
+
+int main() {
+    char buffer[16];
+    volatile int count = 20;
+    int n = count;
+    for (int i = 0; i < n; ++i)
+        buffer[i] = 'A';
+}
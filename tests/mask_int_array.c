@@ -0,0 +1,8 @@
+// passes: vaporeonpass<mask-indices>
+
+int main() {
+    int numbers[256];
+    volatile int index = 100;
+    numbers[index] = 1;
+    numbers[index + 300] = 2;
+}
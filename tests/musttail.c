@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+int fill(char* buffer, int i) {
+    buffer[i] = 'A';
+    return buffer[0];
+}
+
+int forward(char* buffer, int i) {
+    buffer[i + 1] = 'B';
+    __attribute__((musttail)) return fill(buffer, i);
+}
+
+int main() {
+    char buffer[16];
+    printf("%c\n", forward(buffer, 0));
+    forward(buffer, 15);
+}
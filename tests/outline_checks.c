@@ -0,0 +1,7 @@
+// passes: vaporeonpass<outline-checks>
+
+int main() {
+    char buffer[8];
+    volatile int index = 8;
+    buffer[index] = 'A';
+}
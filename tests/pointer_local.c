@@ -0,0 +1,12 @@
+int main() {
+    char small[4];
+    char large[16];
+    volatile int pick = 0;
+    char *p;
+    if (pick)
+        p = large;
+    else
+        p = small;
+    volatile int index = 8;
+    p[index] = 'A';
+}
@@ -0,0 +1,13 @@
+#include <stdio.h>
+
+struct vaporeon_site { const char *function, *file; unsigned line, column; };
+
+void __vaporeon_report(const struct vaporeon_site *site) {
+    fprintf(stderr, "out of bounds in %s()\n", site->function);
+}
+
+int main() {
+    char buffer[8];
+    volatile int index = 8;
+    buffer[index] = 'A';
+}
@@ -0,0 +1,21 @@
+// passes: vaporeonpass<runtime-toggle>
+#include <stdio.h>
+
+// defined by the pass; null in the uninstrumented build
+void __vaporeon_set_checks_enabled(int enabled) __attribute__((weak));
+
+void put(int index) {
+    char spare[16];
+    char buffer[16];
+    buffer[index] = 'A';
+}
+
+int main() {
+    if (__vaporeon_set_checks_enabled)
+        __vaporeon_set_checks_enabled(0);
+    put(16);
+    fputs("unchecked\n", stderr);
+    if (__vaporeon_set_checks_enabled)
+        __vaporeon_set_checks_enabled(1);
+    put(16);
+}
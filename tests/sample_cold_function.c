@@ -0,0 +1,16 @@
+// passes: vaporeonpass<sample=64>
+
+void hot(char* buffer, int i) {
+    buffer[i] = 'h';
+}
+
+void cold(char* buffer, int i) {
+    buffer[i] = 'c';
+}
+
+int main() {
+    char buffer[8];
+    for (int i = 0; i < 1000; ++i)
+        hot(buffer, i % 8);
+    cold(buffer, 8);
+}
@@ -0,0 +1,10 @@
+// passes: vaporeonpass<shadow-bounds>
+
+char *saved;
+
+int main() {
+    char buffer[8];
+    saved = buffer;
+    volatile int index = 8;
+    saved[index] = 'A';
+}
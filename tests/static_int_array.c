@@ -0,0 +1,6 @@
+int main() {
+    int numbers[4];
+    numbers[0] = 1;
+    numbers[1] = 2;
+    numbers[3] = 4;
+}
@@ -0,0 +1,10 @@
+// passes: function(mem2reg),vaporeonpass
+
+int main() {
+    char buffer[16];
+    char *d = buffer;
+    volatile int count = 20;
+    int n = count;
+    for (int i = 0; i < n; ++i)
+        *d++ = 'A';
+}
@@ -0,0 +1,6 @@
+int main() {
+    char buffer[16];
+    volatile int index = 20;
+    buffer[index & 15] = 'a';
+    buffer[index & 31] = 'b';
+}
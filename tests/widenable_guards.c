@@ -0,0 +1,9 @@
+// passes: vaporeonpass<widenable-guards>,function(mem2reg,instcombine,guard-widening,loop-mssa(loop-predication),lower-widenable-condition)
+
+int main() {
+    char buffer[16];
+    volatile int count = 20;
+    int n = count;
+    for (int i = 0; i < n; ++i)
+        buffer[i] = 'A';
+}
@@ -1,43 +1,2999 @@
 #include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopIterator.h"
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Triple.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include <functional>
 #include <iostream>
+#include <optional>
+#include <tuple>
 
 using namespace llvm;
 
 constexpr bool PRINTDEBUG = false;
 
+// Called by codegen for llvm.experimental.deoptimize; defined to trap, since
+// there is no runtime to deoptimize into.
+constexpr const char *DeoptimizeTrapName = "__llvm_deoptimize";
+// __vaporeon_trap(site_id) is the module's trap stub, called by every trap
+// block. __vaporeon_sites maps site IDs to
+// `{ const char *function, *file; unsigned line, column; }`, and the stub
+// passes the entry of the failing site to __vaporeon_report, if the program
+// defines it, before trapping.
+constexpr const char *TrapHandlerName = "__vaporeon_trap";
+constexpr const char *SiteTableName = "__vaporeon_sites";
+constexpr const char *ReportHookName = "__vaporeon_report";
+// Outlined checks: __vaporeon_check(ptr, lower, size, site_id) and, for
+// strength-reduced checks, __vaporeon_check_limit(ptr, limit, site_id).
+constexpr const char *CheckThunkName = "__vaporeon_check";
+constexpr const char *LimitCheckThunkName = "__vaporeon_check_limit";
+// With runtime toggles, instrumented functions run their unchecked clone
+// while __vaporeon_checks_enabled is zero. The flag and its setter,
+// __vaporeon_set_checks_enabled(int), are weak so all modules share them.
+constexpr const char *ChecksEnabledName = "__vaporeon_checks_enabled";
+constexpr const char *SetChecksEnabledName = "__vaporeon_set_checks_enabled";
+// Sampling: each thread keeps a countdown per function F,
+// __vaporeon_sample_countdown.F, and runs F's checks only when it reaches
+// zero, after calling __vaporeon_sample(countdown) to rearm it.
+// __vaporeon_samples counts how often each site ran, and a destructor passes
+// every sampled site and its count to __vaporeon_sample_report, if the
+// program defines it.
+constexpr const char *SampleCountdownName = "__vaporeon_sample_countdown";
+constexpr const char *SampleSeedName = "__vaporeon_sample_seed";
+constexpr const char *SamplerName = "__vaporeon_sample";
+constexpr const char *SampleCountsName = "__vaporeon_samples";
+constexpr const char *SampleReporterName = "__vaporeon_report_samples";
+constexpr const char *SampleReportHookName = "__vaporeon_sample_report";
+// Guard pages: __vaporeon_guarded_alloc(slot, size) returns a buffer of size
+// bytes whose end abuts a PROT_NONE page, and __vaporeon_guarded_free(slot,
+// buffer, size) releases it. Each stack array moved off the stack has a
+// thread-local slot `{ ptr buffer; i32 busy; i64 size; }` caching its
+// mapping, so only the first call on a thread, or a recursive one, maps
+// memory. Caching a mapping registers __vaporeon_guarded_exit(slot) with
+// __cxa_thread_atexit_impl, which unmaps it when the thread exits.
+constexpr const char *GuardedAllocName = "__vaporeon_guarded_alloc";
+constexpr const char *GuardedFreeName = "__vaporeon_guarded_free";
+constexpr const char *GuardedExitName = "__vaporeon_guarded_exit";
+// Audit mode: a failed check only sets a per-function violation flag. Where
+// the flag is examined, __vaporeon_audit(site_id) stores the site's table
+// entry into the thread's __vaporeon_first_violation, if that is still null,
+// and passes it to __vaporeon_report, if the program defines it.
+constexpr const char *AuditName = "__vaporeon_audit";
+constexpr const char *FirstViolationName = "__vaporeon_first_violation";
+// Fuzzing: __vaporeon_cov holds a libFuzzer inline 8-bit counter per check
+// site, bumped whenever the site's check runs, and __vaporeon_cov_pcs the
+// matching `{ pc, flags }` table. The constructor __vaporeon_cov_init
+// registers both with __sanitizer_cov_8bit_counters_init and
+// __sanitizer_cov_pcs_init when the program is linked with libFuzzer.
+constexpr const char *CoverageCountersName = "__vaporeon_cov";
+constexpr const char *CoveragePCsName = "__vaporeon_cov_pcs";
+constexpr const char *CoverageInitName = "__vaporeon_cov_init";
+// libFuzzer calls LLVMFuzzerTestOneInput(data, size) with a raw pointer, so
+// data is bounded by size.
+constexpr const char *FuzzTargetName = "LLVMFuzzerTestOneInput";
+// Shadow bounds: a pointer stored to memory other than a pointer local keeps
+// its bounds in __vaporeon_shadow, a table of `{ ptr key, lower; i64 size; }`
+// entries indexed by bits 3 and up of the address it is stored at. The key is
+// the stored pointer, so a load finds the bounds only if the entry still
+// describes the pointer it loaded. Stores clear the key while they rewrite
+// the bounds, and loads read it on both sides of them, so racing threads
+// miss instead of mixing entries. __vaporeon_shadow_map() reserves the table
+// on first use and __vaporeon_shadow_entry(addr) returns addr's entry.
+constexpr const char *ShadowTableName = "__vaporeon_shadow";
+constexpr const char *ShadowMapName = "__vaporeon_shadow_map";
+constexpr const char *ShadowEntryName = "__vaporeon_shadow_entry";
+// 2^26 entries of 24 bytes, reserved but only backed where they are written
+constexpr unsigned ShadowIndexBits = 26;
+// Functions annotated with __attribute__((annotate("vaporeon_mask"))) mask
+// indices as with the mask-indices parameter.
+constexpr const char *MaskAnnotation = "vaporeon_mask";
+// Marks unchecked clones, which are not instrumented again.
+constexpr const char *UncheckedAttr = "vaporeon-unchecked";
+// Branch weights of a check, the ratio __builtin_expect uses.
+constexpr uint32_t TrapWeight = 1, InBoundsWeight = 2000;
+
 namespace {
+struct FatPointer {
+  Value *lower, *size;
+};
+
+// A store that needs `ptr - lower <u size` to hold before it executes.
+struct BoundsCheck {
+  StoreInst *SI;
+  Value *ptr;
+  FatPointer bounds;
+  // If set, the check is strength-reduced to `ptr >=u limit`.
+  Value *limit = nullptr;
+  // If set, the check runs here instead of right before SI.
+  Instruction *insertPt = nullptr;
+};
+
+// A condition tested before insertPt that traps when true, reported with the
+// location of the store or call it was derived from.
+struct Guard {
+  Value *cond;
+  Instruction *insertPt;
+  DebugLoc loc;
+};
+
+// Writes through pointer argument ArgNo stay within [arg, arg + Extent),
+// where Extent is a SCEV over the function's arguments.
+struct AccessSummary {
+  unsigned ArgNo;
+  const SCEV *Extent;
+};
+
+// A call to a summarized function. It is checked once against the extent of
+// each summarized pointer argument, as (pointer, extent in bytes) pairs, and
+// then calls Clone, which skips the checks those extents cover.
+struct SummarizedCall {
+  Function *Clone = nullptr;
+  SmallVector<std::pair<Value *, Value *>, 2> args;
+};
+
+struct ModuleSummaries {
+  DenseMap<Function *, SmallVector<AccessSummary, 2>> summaries;
+  // summarized function -> clone, in bottom-up order
+  MapVector<Function *, Function *> clones;
+  // clone -> arguments whose writes its callers check
+  DenseMap<Function *, SmallVector<unsigned, 2>> exemptArgs;
+  DenseMap<CallBase *, SummarizedCall> calls;
+};
+
+// Warning that a store is out of bounds on every execution. It has its own
+// plugin diagnostic kind, so frontends treat it like any other warning:
+// -Werror promotes it and handlers can tell it apart from unsupported IR.
+class DiagnosticInfoAlwaysTraps : public DiagnosticInfoWithLocationBase {
+public:
+  DiagnosticInfoAlwaysTraps(const Function &Fn, const DiagnosticLocation &Loc)
+      : DiagnosticInfoWithLocationBase(static_cast<DiagnosticKind>(kind()),
+                                       DS_Warning, Fn, Loc) {}
+
+  void print(DiagnosticPrinter &DP) const override {
+    DP << getLocationStr() << ": in function " << getFunction().getName()
+       << ": store is always out of bounds and will trap";
+  }
+
+  static int kind() {
+    static const int Kind = getNextAvailablePluginDiagnosticKind();
+    return Kind;
+  }
+
+  static bool classof(const DiagnosticInfo *DI) {
+    return DI->getKind() == kind();
+  }
+};
+
+// How an inline check on a store is lowered:
+// - Fused: `ptr - lower >=u size`, one subtract and one compare.
+// - Split: `ptr <u lower` and `ptr >=u lower + size`, each with its own
+//   branch to the trap block.
+// - EndPointer: `ptr <u lower | ptr >=u end`, with `end = lower + size`
+//   computed once where the bounds are defined instead of at every check.
+// - Overflow: `ptr - lower + width - 1` through llvm.uadd.with.overflow,
+//   trapping on overflow or when it is `>=u size`, so the last byte the
+//   store writes is checked as well.
+enum class CheckEncoding { Fused, Split, EndPointer, Overflow };
+
+struct VaporeonOptions {
+  // Replace per-iteration checks on affine loop accesses with a single range
+  // check in the loop preheader.
+  bool LoopHoist = false;
+  // Clone loops into an unchecked copy guarded by one range test in the
+  // preheader, falling back to the checked loop when the test fails.
+  bool LoopVersion = false;
+  // Check stores through increasing pointer induction variables with one
+  // compare against a limit pointer computed in the preheader.
+  bool StrengthReduce = true;
+  // Drop checks on constant offsets proven in bounds at compile time and warn
+  // about the ones proven out of bounds.
+  bool StaticChecks = true;
+  // Drop checks whose variable GEP indices are proven in bounds by
+  // LazyValueInfo ranges, e.g. `buf[i % N]` or `buf[i & (N - 1)]`.
+  bool ValueRanges = true;
+  // Drop checks implied by a dominating check on the same base pointer.
+  bool DominatedChecks = true;
+  // Keep only the bounds loads and phis that checks or calls end up using,
+  // and load the bounds of incoming fat pointers just before their first
+  // use outside loops rather than at entry.
+  bool LazyBounds = true;
+  // Pack loop-invariant fat pointers passed to calls in a loop once, in its
+  // preheader, when MemorySSA shows nothing else in the loop writes them.
+  bool ForwardBounds = true;
+  // Merge the checks of a basic block that share a base pointer and bounds
+  // into one check of the lowest and highest offset written.
+  bool Coalesce = false;
+  // Move checks into colder blocks that dominate them, by BlockFrequencyInfo.
+  bool CheckMotion = false;
+  // Maximum expected number of checks executed per call; the hottest checks
+  // beyond it are dropped. Zero means unlimited.
+  unsigned Budget = 0;
+  // Summarize the writes each function makes through its pointer arguments,
+  // bottom-up over the call graph, and check calls once against the summary
+  // instead of checking every store in the callee. Module pass only.
+  bool Interprocedural = false;
+  // Emit checks as widenable branches that deoptimize on failure, so
+  // GuardWidening and LoopPredication can merge and hoist them.
+  bool WidenableGuards = false;
+  // Call shared check thunks instead of emitting the compare and branch
+  // inline, for checks expected to run fewer than OutlineHotness times per
+  // call, or for every check in optsize or minsize functions.
+  bool OutlineChecks = false;
+  unsigned OutlineHotness = 8;
+  // Lowering of the inline checks on stores left after the steps above.
+  CheckEncoding Encoding = CheckEncoding::Fused;
+  // Keep an unchecked clone of every instrumented function and branch to it
+  // on entry while checks are disabled at runtime.
+  bool RuntimeToggle = false;
+  // Run checks on only one in SamplePeriod of the calls a thread makes to a
+  // function, running its unchecked clone otherwise, or with SampleSites on
+  // one in SamplePeriod of the checks a thread executes. Zero or one checks
+  // every execution.
+  unsigned SamplePeriod = 0;
+  bool SampleSites = false;
+  // Instead of trapping, clamp the pointer of each checked store into its
+  // bounds: `lower + ((ptr - lower) & (size - 1))` for power-of-two constant
+  // sizes in bytes, with the bits below the store's width cleared as well,
+  // otherwise `ptr - lower <u size ? ptr : lower`.
+  bool MaskIndices = false;
+  // Move fixed-size stack arrays of at least GuardPageThreshold bytes into
+  // buffers ending at a guard page and drop the checks on their stores,
+  // leaving linear overflows to the MMU. Zero disables it.
+  uint64_t GuardPageThreshold = 0;
+  // Instead of branching to the trap on each failed check, record it in a
+  // violation flag examined at loop exits, calls and returns, and report the
+  // violation there without trapping.
+  bool Audit = false;
+  // Report violations in a form libFuzzer catches as a crash, and export a
+  // coverage counter per check site.
+  bool Fuzz = false;
+  // Keep the bounds of pointers stored to the heap, globals and aggregates in
+  // a direct-mapped shadow table, and look them up where they are loaded.
+  bool ShadowBounds = false;
+};
+
+// Parses the `vaporeonpass<...>` parameter list, e.g. `vaporeonpass<loop-hoist>`.
+Expected<VaporeonOptions> parseVaporeonOptions(StringRef Params) {
+  VaporeonOptions Options;
+  while (!Params.empty()) {
+    StringRef ParamName;
+    std::tie(ParamName, Params) = Params.split(';');
+    bool Enable = !ParamName.consume_front("no-");
+    if (ParamName == "loop-hoist") {
+      Options.LoopHoist = Enable;
+    } else if (ParamName == "loop-version") {
+      Options.LoopVersion = Enable;
+    } else if (ParamName == "strength-reduce") {
+      Options.StrengthReduce = Enable;
+    } else if (ParamName == "static-checks") {
+      Options.StaticChecks = Enable;
+    } else if (ParamName == "forward-bounds") {
+      Options.ForwardBounds = Enable;
+    } else if (ParamName == "lazy-bounds") {
+      Options.LazyBounds = Enable;
+    } else if (ParamName == "value-ranges") {
+      Options.ValueRanges = Enable;
+    } else if (ParamName == "dominated-checks") {
+      Options.DominatedChecks = Enable;
+    } else if (ParamName == "coalesce") {
+      Options.Coalesce = Enable;
+    } else if (ParamName == "check-motion") {
+      Options.CheckMotion = Enable;
+    } else if (ParamName == "interprocedural") {
+      Options.Interprocedural = Enable;
+    } else if (ParamName == "widenable-guards") {
+      Options.WidenableGuards = Enable;
+    } else if (ParamName == "runtime-toggle") {
+      Options.RuntimeToggle = Enable;
+    } else if (ParamName == "fuzz") {
+      Options.Fuzz = Enable;
+    } else if (ParamName == "shadow-bounds") {
+      Options.ShadowBounds = Enable;
+    } else if (ParamName == "audit") {
+      Options.Audit = Enable;
+    } else if (ParamName == "mask-indices") {
+      Options.MaskIndices = Enable;
+    } else if (ParamName == "outline-checks") {
+      Options.OutlineChecks = Enable;
+    } else if (ParamName.consume_front("outline-hotness=")) {
+      if (ParamName.getAsInteger(0, Options.OutlineHotness))
+        return make_error<StringError>(
+            formatv("invalid vaporeonpass outline-hotness '{0}'", ParamName)
+                .str(),
+            inconvertibleErrorCode());
+    } else if (ParamName.consume_front("check-encoding=")) {
+      std::optional<CheckEncoding> Encoding =
+          StringSwitch<std::optional<CheckEncoding>>(ParamName)
+              .Case("fused", CheckEncoding::Fused)
+              .Case("split", CheckEncoding::Split)
+              .Case("end", CheckEncoding::EndPointer)
+              .Case("overflow", CheckEncoding::Overflow)
+              .Default(std::nullopt);
+      if (!Encoding)
+        return make_error<StringError>(
+            formatv("invalid vaporeonpass check-encoding '{0}'", ParamName)
+                .str(),
+            inconvertibleErrorCode());
+      Options.Encoding = *Encoding;
+    } else if (ParamName == "sample-sites") {
+      Options.SampleSites = Enable;
+    } else if (ParamName.consume_front("guard-pages=")) {
+      if (ParamName.getAsInteger(0, Options.GuardPageThreshold))
+        return make_error<StringError>(
+            formatv("invalid vaporeonpass guard-pages threshold '{0}'",
+                    ParamName)
+                .str(),
+            inconvertibleErrorCode());
+    } else if (ParamName.consume_front("sample=")) {
+      if (ParamName.getAsInteger(0, Options.SamplePeriod))
+        return make_error<StringError>(
+            formatv("invalid vaporeonpass sample period '{0}'", ParamName)
+                .str(),
+            inconvertibleErrorCode());
+    } else if (ParamName.consume_front("budget=")) {
+      if (ParamName.getAsInteger(0, Options.Budget))
+        return make_error<StringError>(
+            formatv("invalid vaporeonpass budget '{0}'", ParamName).str(),
+            inconvertibleErrorCode());
+    } else {
+      return make_error<StringError>(
+          formatv("invalid vaporeonpass parameter '{0}'", ParamName).str(),
+          inconvertibleErrorCode());
+    }
+  }
+  return Options;
+}
+
 struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
+  VaporeonOptions Options;
+
+  VaporeonPass(VaporeonOptions Options = {}) : Options(Options) {}
+
+  enum class StaticResult { InBounds, OutOfBounds, Unknown };
+
+  // Evaluates `ptr - lower >=u size` at compile time when ptr and lower are
+  // constant offsets from the same base and size is a constant.
+  static StaticResult evaluateStatically(const BoundsCheck &C,
+                                         const DataLayout &DL) {
+    auto *size = dyn_cast<ConstantInt>(C.bounds.size);
+    if (!size)
+      return StaticResult::Unknown;
+    unsigned IndexWidth = DL.getIndexTypeSizeInBits(C.ptr->getType());
+    APInt ptrOffset(IndexWidth, 0), lowerOffset(IndexWidth, 0);
+    auto *ptrBase = C.ptr->stripAndAccumulateConstantOffsets(DL, ptrOffset,
+                                                             true);
+    auto *lowerBase = C.bounds.lower->stripAndAccumulateConstantOffsets(
+        DL, lowerOffset, true);
+    if (ptrBase != lowerBase)
+      return StaticResult::Unknown;
+    APInt diff = (ptrOffset - lowerOffset).sextOrTrunc(64);
+    return diff.uge(size->getZExtValue()) ? StaticResult::OutOfBounds
+                                          : StaticResult::InBounds;
+  }
+
+  // Range of integer V at CxtI. LazyValueInfo handles urem, and-masks,
+  // min/max clamps and extensions, but gives up on loop-carried values, so
+  // the SCEV range is intersected in and arithmetic on such values (e.g. the
+  // srem in `buf[i % N]`) is re-evaluated from its operands' ranges.
+  static ConstantRange valueRange(Value *V, Instruction *CxtI,
+                                  LazyValueInfo &LVI, ScalarEvolution &SE,
+                                  unsigned depth = 0) {
+    auto range = LVI.getConstantRange(V, CxtI, false);
+    if (SE.isSCEVable(V->getType()))
+      range = range.intersectWith(SE.getSignedRange(SE.getSCEV(V)),
+                                  ConstantRange::Signed);
+    if (depth >= 4)
+      return range;
+    if (auto *BO = dyn_cast<BinaryOperator>(V)) {
+      auto lhs = valueRange(BO->getOperand(0), CxtI, LVI, SE, depth + 1);
+      auto rhs = valueRange(BO->getOperand(1), CxtI, LVI, SE, depth + 1);
+      range = range.intersectWith(
+          lhs.binaryOp(BO->getOpcode(), rhs),
+          ConstantRange::Signed);
+    } else if (auto *CI = dyn_cast<CastInst>(V)) {
+      if (CI->getSrcTy()->isIntegerTy()) {
+        auto src = valueRange(CI->getOperand(0), CxtI, LVI, SE, depth + 1);
+        range = range.intersectWith(
+            src.castOp(CI->getOpcode(),
+                       CI->getDestTy()->getIntegerBitWidth()),
+            ConstantRange::Signed);
+      }
+    }
+    return range;
+  }
+
+  // Proves `ptr - lower <u size` for every value the GEP indices leading from
+  // lower's base to ptr can take at the store.
+  static bool provenByValueRanges(const BoundsCheck &C, const DataLayout &DL,
+                                  LazyValueInfo &LVI, ScalarEvolution &SE) {
+    APInt lowerOffset(DL.getIndexTypeSizeInBits(C.bounds.lower->getType()),
+                      0);
+    auto *lowerBase = C.bounds.lower->stripAndAccumulateConstantOffsets(
+        DL, lowerOffset, true);
+
+    ConstantRange offset(APInt(64, 0));
+    Value *base = C.ptr;
+    while (auto *GEP = dyn_cast<GEPOperator>(base)) {
+      MapVector<Value *, APInt> variableOffsets;
+      APInt constantOffset(64, 0);
+      if (!GEP->collectOffset(DL, 64, variableOffsets, constantOffset))
+        return false;
+      offset = offset.add(ConstantRange(constantOffset));
+      for (auto &[index, scale] : variableOffsets) {
+        auto indexRange = valueRange(index, C.SI, LVI, SE);
+        offset = offset.add(
+            indexRange.sextOrTrunc(64).multiply(ConstantRange(scale)));
+      }
+      base = GEP->getPointerOperand();
+    }
+    if (base != lowerBase)
+      return false;
+
+    auto diff = offset.sub(ConstantRange(lowerOffset.sextOrTrunc(64)));
+    auto sizeRange = valueRange(C.bounds.size, C.SI, LVI, SE).zextOrTrunc(64);
+    return diff.getUnsignedMax().ult(sizeRange.getUnsignedMin());
+  }
+
+  // Returns lower's constant offset from base, if lower is base or a
+  // constant offset from it.
+  static std::optional<int64_t> offsetOfLower(const FatPointer &bounds,
+                                              Value *base,
+                                              const DataLayout &DL) {
+    APInt offset(DL.getIndexTypeSizeInBits(bounds.lower->getType()), 0);
+    if (bounds.lower->stripAndAccumulateConstantOffsets(DL, offset, true) !=
+            base ||
+        !offset.isSignedIntN(64))
+      return std::nullopt;
+    return offset.getSExtValue();
+  }
+
+  // Reorders checks so that in each run of stores in one block through
+  // constant offsets at or above lower from the same base, the check of the
+  // highest offset comes first and runs before the first store of the run.
+  // That check vouches for the rest of the run. A run ends at an instruction
+  // that may not fall through, so the moved check only traps when the store
+  // it guards would have run.
+  static std::vector<BoundsCheck>
+  checkHighestOffsetsFirst(const std::vector<BoundsCheck> &checks,
+                           DominatorTree &DT, const DataLayout &DL) {
+    struct Run {
+      Value *base;
+      SmallVector<std::pair<size_t, int64_t>, 4> members;
+    };
+    using RunKey = std::tuple<unsigned, Value *, Value *, Value *>;
+
+    DenseMap<StoreInst *, size_t> indexOf;
+    SetVector<BasicBlock *> blocks;
+    for (size_t i = 0; i < checks.size(); ++i) {
+      indexOf[checks[i].SI] = i;
+      blocks.insert(checks[i].SI->getParent());
+    }
+
+    std::vector<BoundsCheck> moved = checks;
+    // the index of each run's first check, and of its highest
+    DenseMap<size_t, size_t> highestBefore;
+    DenseSet<size_t> highest;
+    for (auto *BB : blocks) {
+      MapVector<RunKey, Run> runs;
+      unsigned segment = 0;
+      for (auto &I : *BB) {
+        if (auto *SI = dyn_cast<StoreInst>(&I); SI && indexOf.contains(SI)) {
+          auto &C = checks[indexOf[SI]];
+          APInt offset(DL.getIndexTypeSizeInBits(C.ptr->getType()), 0);
+          auto *base = C.ptr->stripAndAccumulateConstantOffsets(DL, offset,
+                                                                true);
+          auto lowerOffset = offsetOfLower(C.bounds, base, DL);
+          if (!C.limit && !C.insertPt && offset.isSignedIntN(64) &&
+              lowerOffset && *lowerOffset <= offset.getSExtValue()) {
+            auto &R = runs[{segment, base, C.bounds.lower, C.bounds.size}];
+            R.base = base;
+            R.members.push_back({indexOf[SI], offset.getSExtValue()});
+          }
+        }
+        if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+          ++segment;
+      }
+
+      for (auto &[key, R] : runs) {
+        if (R.members.size() < 2)
+          continue;
+        size_t first = R.members.front().first;
+        auto [top, topOffset] = *std::max_element(
+            R.members.begin(), R.members.end(),
+            [](auto &A, auto &B) { return A.second < B.second; });
+        auto *InsertPt = checks[first].SI;
+        auto &C = moved[top];
+        bool available = all_of(
+            ArrayRef<Value *>{R.base, C.bounds.lower, C.bounds.size},
+            [&](Value *V) { return DT.dominates(V, InsertPt); });
+        if (top == first || !available)
+          continue;
+        if (!DT.dominates(C.ptr, InsertPt))
+          C.ptr = GetElementPtrInst::Create(
+              Type::getInt8Ty(BB->getContext()), R.base,
+              {ConstantInt::get(Type::getInt64Ty(BB->getContext()), topOffset,
+                                true)},
+              "", InsertPt);
+        C.insertPt = InsertPt;
+        highestBefore[first] = top;
+        highest.insert(top);
+      }
+    }
+
+    std::vector<BoundsCheck> reordered;
+    for (size_t i = 0; i < moved.size(); ++i) {
+      if (highest.contains(i))
+        continue;
+      if (auto It = highestBefore.find(i); It != highestBefore.end())
+        reordered.push_back(moved[It->second]);
+      reordered.push_back(moved[i]);
+    }
+    return reordered;
+  }
+
+  // Removes checks implied by a dominating check against the same bounds.
+  // Once base+a and base+b have passed, every offset in [a, b] is in bounds,
+  // so the table maps (base, lower, size) to the widest verified interval on
+  // the current dominator tree path. When lower is a constant offset from
+  // base, a passed offset also vouches for every offset down to lower's,
+  // and checkHighestOffsetsFirst lets one check cover a run of stores at
+  // increasing offsets, such as `buf[0] = a; buf[1] = b;`. coveredBy maps
+  // the store of each removed check to the stores whose checks verified
+  // the ends of its interval.
+  static std::vector<BoundsCheck> eliminateDominatedChecks(
+      const std::vector<BoundsCheck> &input, DominatorTree &DT,
+      const DataLayout &DL,
+      MapVector<StoreInst *, std::pair<StoreInst *, StoreInst *>> &coveredBy) {
+    auto checks = checkHighestOffsetsFirst(input, DT, DL);
+    using FactKey = std::tuple<Value *, Value *, Value *>;
+    struct Interval {
+      int64_t first, second;
+      StoreInst *firstBy, *secondBy;
+    };
+    DenseMap<FactKey, Interval> verified;
+    DenseMap<BasicBlock *, SmallVector<const BoundsCheck *, 4>> blockChecks;
+    for (auto &C : checks)
+      blockChecks[C.SI->getParent()].push_back(&C);
+
+    DenseSet<const BoundsCheck *> redundant;
+    std::function<void(DomTreeNode *)> visit = [&](DomTreeNode *N) {
+      SmallVector<std::pair<FactKey, std::optional<Interval>>, 4> undo;
+      for (auto *C : blockChecks.lookup(N->getBlock())) {
+        APInt offset(DL.getIndexTypeSizeInBits(C->ptr->getType()), 0);
+        auto *base = C->ptr->stripAndAccumulateConstantOffsets(DL, offset,
+                                                               true);
+        if (!offset.isSignedIntN(64))
+          continue;
+        int64_t off = offset.getSExtValue();
+        FactKey key = {base, C->bounds.lower, C->bounds.size};
+        auto it = verified.find(key);
+        if (it != verified.end() && it->second.first <= off &&
+            off <= it->second.second) {
+          redundant.insert(C);
+          coveredBy[C->SI] = {it->second.firstBy, it->second.secondBy};
+          continue;
+        }
+        // off - lower's offset passed `<u size`, and so does anything
+        // between
+        int64_t from = off;
+        if (auto lowerOffset = offsetOfLower(C->bounds, base, DL);
+            lowerOffset && *lowerOffset <= off)
+          from = *lowerOffset;
+        if (it == verified.end()) {
+          undo.push_back({key, std::nullopt});
+          verified[key] = {from, off, C->SI, C->SI};
+          continue;
+        }
+        undo.push_back({key, it->second});
+        if (from < it->second.first)
+          it->second = {from, it->second.second, C->SI, it->second.secondBy};
+        if (off > it->second.second)
+          it->second = {it->second.first, off, it->second.firstBy, C->SI};
+      }
+      for (auto *Child : N->children())
+        visit(Child);
+      for (auto &[key, previous] : reverse(undo)) {
+        if (previous)
+          verified[key] = *previous;
+        else
+          verified.erase(key);
+      }
+    };
+    visit(DT.getRootNode());
+
+    std::vector<BoundsCheck> remaining;
+    for (auto &C : checks)
+      if (!redundant.contains(&C))
+        remaining.push_back(C);
+    return remaining;
+  }
+
+  // Merges checks in one basic block that share a base pointer and bounds
+  // into a single check of the lowest and highest offset, placed at the first
+  // of those stores. A group never spans an instruction that may not fall
+  // through, so the merged check only traps on paths where one of the
+  // original stores would have. Merged checks are appended to guards as
+  // (condition, split point) pairs; the rest are returned.
+  static std::vector<BoundsCheck>
+  coalesceBlockChecks(const std::vector<BoundsCheck> &checks,
+                      const DataLayout &DL,
+                      std::vector<Guard> &guards,
+                      int &instructionsAdded) {
+    struct Group {
+      Value *base;
+      FatPointer bounds;
+      int64_t minOffset, maxOffset;
+      SmallVector<const BoundsCheck *, 4> members;
+    };
+    using GroupKey = std::tuple<unsigned, Value *, Value *, Value *>;
+
+    DenseMap<StoreInst *, const BoundsCheck *> checkFor;
+    SetVector<BasicBlock *> blocks;
+    for (auto &C : checks) {
+      checkFor[C.SI] = &C;
+      blocks.insert(C.SI->getParent());
+    }
+
+    std::vector<BoundsCheck> remaining;
+    for (auto *BB : blocks) {
+      MapVector<GroupKey, Group> groups;
+      unsigned segment = 0;
+      for (auto &I : *BB) {
+        if (auto *C = checkFor.lookup(dyn_cast<StoreInst>(&I))) {
+          if (C->limit || C->insertPt) {
+            remaining.push_back(*C);
+            continue;
+          }
+          APInt offset(DL.getIndexTypeSizeInBits(C->ptr->getType()), 0);
+          auto *base = C->ptr->stripAndAccumulateConstantOffsets(DL, offset,
+                                                                 true);
+          if (!offset.isSignedIntN(64)) {
+            remaining.push_back(*C);
+            continue;
+          }
+          int64_t off = offset.getSExtValue();
+          GroupKey key = {segment, base, C->bounds.lower, C->bounds.size};
+          auto [it, inserted] =
+              groups.insert({key, Group{base, C->bounds, off, off, {}}});
+          it->second.minOffset = std::min(it->second.minOffset, off);
+          it->second.maxOffset = std::max(it->second.maxOffset, off);
+          it->second.members.push_back(C);
+        }
+        if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+          ++segment;
+      }
+
+      for (auto &[key, G] : groups) {
+        auto *InsertPt = G.members.front()->SI;
+        bool available = all_of(
+            ArrayRef<Value *>{G.bounds.lower, G.bounds.size}, [&](Value *V) {
+              auto *I = dyn_cast<Instruction>(V);
+              return !I || I->getParent() != BB || I->comesBefore(InsertPt);
+            });
+        if (G.members.size() < 2 || !available) {
+          for (auto *C : G.members)
+            remaining.push_back(*C);
+          continue;
+        }
+        auto &Ctx = BB->getContext();
+        auto offsetFromBase = [&](int64_t off) -> Value * {
+          if (off == 0)
+            return G.base;
+          return GetElementPtrInst::Create(
+              Type::getInt8Ty(Ctx), G.base,
+              {ConstantInt::get(Type::getInt64Ty(Ctx), off, true)}, "",
+              InsertPt);
+        };
+        auto *belowMin =
+            emitOutOfBounds(offsetFromBase(G.minOffset), G.bounds, InsertPt);
+        auto *aboveMax =
+            emitOutOfBounds(offsetFromBase(G.maxOffset), G.bounds, InsertPt);
+        Value *cond =
+            BinaryOperator::CreateOr(belowMin, aboveMax, "", InsertPt);
+        guards.push_back({cond, InsertPt, InsertPt->getDebugLoc()});
+        instructionsAdded += 13;
+        if (PRINTDEBUG)
+          dbgs() << "Coalesced " << G.members.size() << " checks into "
+                 << *cond << "\n";
+      }
+    }
+    return remaining;
+  }
+
+  // Emits `ptr - lower >=u size` before InsertBefore.
+  static Value *emitOutOfBounds(Value *ptr, FatPointer fp,
+                                Instruction *InsertBefore) {
+    auto &Ctx = InsertBefore->getContext();
+    auto *ptrInt =
+        new PtrToIntInst(ptr, Type::getInt64Ty(Ctx), "", InsertBefore);
+    auto *lowerInt =
+        new PtrToIntInst(fp.lower, Type::getInt64Ty(Ctx), "", InsertBefore);
+    auto *diff = BinaryOperator::Create(Instruction::Sub, ptrInt, lowerInt, "",
+                                        InsertBefore);
+    return new ICmpInst(InsertBefore, ICmpInst::ICMP_UGE, diff, fp.size);
+  }
+
+  // Emits `end = lower + size` for fp right after the later of its
+  // definitions, so every check against fp can share it.
+  static Value *emitEndPointer(FatPointer fp, Function &F,
+                               DominatorTree &DT) {
+    Instruction *InsertPt = &*F.getEntryBlock().getFirstInsertionPt();
+    for (Value *V : {fp.lower, fp.size}) {
+      auto *I = dyn_cast<Instruction>(V);
+      if (!I)
+        continue;
+      auto *After = isa<PHINode>(I) ? &*I->getParent()->getFirstInsertionPt()
+                                    : I->getNextNode();
+      if (DT.dominates(InsertPt, After))
+        InsertPt = After;
+    }
+    return GetElementPtrInst::Create(Type::getInt8Ty(F.getContext()),
+                                     fp.lower, {fp.size}, "vaporeon_end",
+                                     InsertPt);
+  }
+
+  // Emits the out-of-bounds conditions of C in Encoding before InsertBefore,
+  // one per branch to the trap block. end is fp's shared end pointer for
+  // CheckEncoding::EndPointer.
+  static SmallVector<Value *, 2>
+  emitEncodedOutOfBounds(const BoundsCheck &C, CheckEncoding Encoding,
+                         Value *end, const DataLayout &DL,
+                         Instruction *InsertBefore) {
+    auto &Ctx = InsertBefore->getContext();
+    switch (Encoding) {
+    case CheckEncoding::Fused:
+      return {emitOutOfBounds(C.ptr, C.bounds, InsertBefore)};
+    case CheckEncoding::Split:
+      end = GetElementPtrInst::Create(Type::getInt8Ty(Ctx), C.bounds.lower,
+                                      {C.bounds.size}, "", InsertBefore);
+      return {new ICmpInst(InsertBefore, ICmpInst::ICMP_ULT, C.ptr,
+                           C.bounds.lower),
+              new ICmpInst(InsertBefore, ICmpInst::ICMP_UGE, C.ptr, end)};
+    case CheckEncoding::EndPointer:
+      return {BinaryOperator::CreateOr(
+          new ICmpInst(InsertBefore, ICmpInst::ICMP_ULT, C.ptr,
+                       C.bounds.lower),
+          new ICmpInst(InsertBefore, ICmpInst::ICMP_UGE, C.ptr, end), "",
+          InsertBefore)};
+    case CheckEncoding::Overflow: {
+      auto *Int64Ty = Type::getInt64Ty(Ctx);
+      auto *ptrInt = new PtrToIntInst(C.ptr, Int64Ty, "", InsertBefore);
+      auto *lowerInt =
+          new PtrToIntInst(C.bounds.lower, Int64Ty, "", InsertBefore);
+      auto *offset = BinaryOperator::Create(Instruction::Sub, ptrInt, lowerInt,
+                                            "", InsertBefore);
+      uint64_t width =
+          DL.getTypeStoreSize(C.SI->getValueOperand()->getType());
+      auto *last = CallInst::Create(
+          Intrinsic::getDeclaration(InsertBefore->getModule(),
+                                    Intrinsic::uadd_with_overflow, {Int64Ty}),
+          {offset, ConstantInt::get(Int64Ty, width ? width - 1 : 0)}, "",
+          InsertBefore);
+      auto *overflow = ExtractValueInst::Create(last, {1}, "", InsertBefore);
+      auto *past = new ICmpInst(
+          InsertBefore, ICmpInst::ICMP_UGE,
+          ExtractValueInst::Create(last, {0}, "", InsertBefore),
+          C.bounds.size);
+      return {BinaryOperator::CreateOr(overflow, past, "", InsertBefore)};
+    }
+    }
+    llvm_unreachable("unknown check encoding");
+  }
+
+  // Emits C's pointer clamped into its bounds before C.SI, without a branch.
+  // Bounds are in bytes, so for a power-of-two buffer of power-of-two
+  // elements masking the byte offset is masking the index, e.g. a[i] of an
+  // int[256] becomes a[i & 255]. The bits below the store's width are
+  // cleared as well, so the whole store lands inside the buffer.
+  static Value *emitMaskedPointer(const BoundsCheck &C, const DataLayout &DL) {
+    auto *InsertBefore = C.SI;
+    auto &Ctx = InsertBefore->getContext();
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *ptrInt = new PtrToIntInst(C.ptr, Int64Ty, "", InsertBefore);
+    auto *lowerInt =
+        new PtrToIntInst(C.bounds.lower, Int64Ty, "", InsertBefore);
+    Value *offset = BinaryOperator::Create(Instruction::Sub, ptrInt, lowerInt,
+                                           "", InsertBefore);
+    auto *size = dyn_cast<ConstantInt>(C.bounds.size);
+    uint64_t width = DL.getTypeStoreSize(C.SI->getValueOperand()->getType());
+    if (size && size->getValue().isPowerOf2()) {
+      APInt mask = size->getValue() - 1;
+      if (isPowerOf2_64(width) && size->getValue().uge(width))
+        mask &= ~APInt(mask.getBitWidth(), width - 1);
+      offset = BinaryOperator::CreateAnd(
+          offset, ConstantInt::get(Int64Ty, mask.zextOrTrunc(64)), "",
+          InsertBefore);
+    } else {
+      auto *inBounds = new ICmpInst(InsertBefore, ICmpInst::ICMP_ULT, offset,
+                                    C.bounds.size);
+      offset = SelectInst::Create(inBounds, offset,
+                                  ConstantInt::get(Int64Ty, 0), "",
+                                  InsertBefore);
+    }
+    return GetElementPtrInst::Create(Type::getInt8Ty(Ctx), C.bounds.lower,
+                                     {offset}, "masked", InsertBefore);
+  }
+
+  // Whether F is called with plain pointers from outside instrumented code,
+  // by the trap stub, the sample reporter or libFuzzer, so its parameters
+  // keep the C calling convention instead of taking fat pointers.
+  bool keepsPlainPointers(const Function &F) const {
+    StringRef Name = F.getName();
+    return Name == ReportHookName || Name == SampleReportHookName ||
+           (Options.Fuzz && Name == FuzzTargetName);
+  }
+
+  // Whether F carries __attribute__((annotate(Annotation))).
+  static bool hasAnnotation(const Function &F, StringRef Annotation) {
+    auto *Annotations =
+        F.getParent()->getNamedGlobal("llvm.global.annotations");
+    if (!Annotations || !Annotations->hasInitializer())
+      return false;
+    auto *Entries = dyn_cast<ConstantArray>(Annotations->getInitializer());
+    if (!Entries)
+      return false;
+    for (auto &Entry : Entries->operands()) {
+      auto *Fields = cast<ConstantStruct>(Entry);
+      if (Fields->getOperand(0)->stripPointerCasts() != &F)
+        continue;
+      auto *Str = dyn_cast<GlobalVariable>(
+          Fields->getOperand(1)->stripPointerCasts());
+      auto *Data = Str && Str->hasInitializer()
+                       ? dyn_cast<ConstantDataArray>(Str->getInitializer())
+                       : nullptr;
+      if (Data && Data->isCString() && Data->getAsCString() == Annotation)
+        return true;
+    }
+    return false;
+  }
+
+  // Emits whether [ptr, ptr + extent) is non-empty and not inside fp's
+  // bounds, i.e. `extent != 0 && (ptr - lower >u size ||
+  // extent >u size - (ptr - lower))`, before InsertBefore.
+  static Value *emitExtentOutOfBounds(Value *ptr, Value *extent, FatPointer fp,
+                                      Instruction *InsertBefore) {
+    auto *Int64Ty = Type::getInt64Ty(InsertBefore->getContext());
+    auto *ptrInt = new PtrToIntInst(ptr, Int64Ty, "", InsertBefore);
+    auto *lowerInt = new PtrToIntInst(fp.lower, Int64Ty, "", InsertBefore);
+    auto *offset = BinaryOperator::Create(Instruction::Sub, ptrInt, lowerInt,
+                                          "", InsertBefore);
+    auto *room = BinaryOperator::Create(Instruction::Sub, fp.size, offset, "",
+                                        InsertBefore);
+    auto *startOutOfBounds =
+        new ICmpInst(InsertBefore, ICmpInst::ICMP_UGT, offset, fp.size);
+    auto *endOutOfBounds =
+        new ICmpInst(InsertBefore, ICmpInst::ICMP_UGT, extent, room);
+    auto *outOfBounds = BinaryOperator::CreateOr(
+        startOutOfBounds, endOutOfBounds, "", InsertBefore);
+    auto *nonEmpty = new ICmpInst(InsertBefore, ICmpInst::ICMP_NE, extent,
+                                  ConstantInt::get(Int64Ty, 0));
+    return BinaryOperator::CreateAnd(nonEmpty, outOfBounds, "", InsertBefore);
+  }
+
+  // Splits the block before Before and branches to trapBlock if cond holds,
+  // passing siteID to the site ID phi that starts trapBlock.
+  static void emitTrapBranch(Value *cond, Instruction *Before,
+                             BasicBlock *trapBlock, unsigned siteID) {
+    auto *new_origBB = Before->getParent()->splitBasicBlockBefore(Before, "");
+    auto *new_orig_target = new_origBB->getSingleSuccessor();
+    auto *br = BranchInst::Create(trapBlock, new_orig_target, cond);
+    cast<PHINode>(trapBlock->front())
+        .addIncoming(
+            ConstantInt::get(Type::getInt32Ty(br->getContext()), siteID),
+            new_origBB);
+    if (!isa<Constant>(cond))
+      br->setMetadata(LLVMContext::MD_prof,
+                      MDBuilder(br->getContext())
+                          .createBranchWeights(TrapWeight, InBoundsWeight));
+    ReplaceInstWithInst(new_origBB->getTerminator(), br);
+  }
+
+  // Splits the block before Before and continues only if `!cond` and
+  // llvm.experimental.widenable.condition both hold, otherwise branching to
+  // deoptBlock. GuardWidening and LoopPredication recognize this form and may
+  // widen the condition into a dominating guard; lower-widenable-condition
+  // later replaces the widenable condition with true. A single compare is
+  // inverted in place so the guard reads as the in-bounds range check those
+  // passes parse.
+  static void emitWidenableBranch(Value *cond, Instruction *Before,
+                                  BasicBlock *deoptBlock) {
+    Value *inBounds;
+    auto *cmp = dyn_cast<ICmpInst>(cond);
+    if (cmp && cmp->use_empty()) {
+      cmp->setPredicate(cmp->getInversePredicate());
+      inBounds = cmp;
+    } else {
+      inBounds = BinaryOperator::CreateNot(cond, "", Before);
+    }
+    auto *widenable = CallInst::Create(
+        Intrinsic::getDeclaration(Before->getModule(),
+                                  Intrinsic::experimental_widenable_condition),
+        {}, "widenable_cond", Before);
+    auto *guard = BinaryOperator::CreateAnd(inBounds, widenable, "", Before);
+    auto *new_origBB = Before->getParent()->splitBasicBlockBefore(Before, "");
+    auto *br = BranchInst::Create(new_origBB->getSingleSuccessor(), deoptBlock,
+                                  guard);
+    br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(br->getContext())
+                        .createBranchWeights(InBoundsWeight, TrapWeight));
+    ReplaceInstWithInst(new_origBB->getTerminator(), br);
+  }
+
+  // Creates Name as a cold, noreturn function in .text.unlikely, so trap code
+  // stays out of the hot text and the paths to it need not keep anything
+  // alive. Returns it with an empty entry block.
+  static Function *createTrapFunction(Module &M, StringRef Name,
+                                      FunctionType *Ty,
+                                      GlobalValue::LinkageTypes Linkage) {
+    auto *Fn = Function::Create(Ty, Linkage, Name, M);
+    Fn->addFnAttr(Attribute::Cold);
+    Fn->addFnAttr(Attribute::NoReturn);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    Fn->addFnAttr(Attribute::NoInline);
+    Fn->setSection(".text.unlikely");
+    BasicBlock::Create(M.getContext(), "", Fn);
+    return Fn;
+  }
+
+  static StructType *getSiteType(LLVMContext &Ctx) {
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    return StructType::get(Ctx, {Ptr, Ptr, Int32Ty, Int32Ty});
+  }
+
+  static Function *getOrDefineDeoptimizeTrap(Module &M) {
+    if (auto *Fn = M.getFunction(DeoptimizeTrapName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Fn = createTrapFunction(
+        M, DeoptimizeTrapName, FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::WeakAnyLinkage);
+    auto *BB = &Fn->getEntryBlock();
+    CallInst::Create(Intrinsic::getDeclaration(&M, Intrinsic::trap), {}, "",
+                     BB);
+    new UnreachableInst(Ctx, BB);
+    return Fn;
+  }
+
+  // Returns the module's __vaporeon_trap(site_id) stub, defining it and an
+  // empty site table on first use. The stub is internal since site IDs index
+  // this module's table.
+  static Function *getOrDefineTrapStub(Module &M) {
+    if (auto *Fn = M.getFunction(TrapHandlerName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *SiteTy = getSiteType(Ctx);
+    auto *TableTy = ArrayType::get(SiteTy, 0);
+    auto *table = new GlobalVariable(M, TableTy, true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, {}),
+                                     SiteTableName);
+    auto report = M.getOrInsertFunction(
+        ReportHookName, Type::getVoidTy(Ctx), PointerType::getUnqual(Ctx));
+    if (auto *Decl = dyn_cast<Function>(report.getCallee());
+        Decl && Decl->isDeclaration())
+      Decl->setLinkage(GlobalValue::ExternalWeakLinkage);
+
+    auto *Fn = createTrapFunction(
+        M, TrapHandlerName,
+        FunctionType::get(Type::getVoidTy(Ctx), {Type::getInt32Ty(Ctx)},
+                          false),
+        GlobalValue::InternalLinkage);
+    auto *Entry = &Fn->getEntryBlock();
+    auto *Report = BasicBlock::Create(Ctx, "report", Fn);
+    auto *Trap = BasicBlock::Create(Ctx, "trap", Fn);
+    auto *hasReport = new ICmpInst(
+        *Entry, ICmpInst::ICMP_NE, report.getCallee(),
+        ConstantPointerNull::get(PointerType::getUnqual(Ctx)));
+    BranchInst::Create(Report, Trap, hasReport, Entry);
+    auto *site = GetElementPtrInst::Create(SiteTy, table, {Fn->getArg(0)},
+                                           "site", Report);
+    CallInst::Create(report, {site}, "", Report);
+    BranchInst::Create(Trap, Report);
+    CallInst::Create(Intrinsic::getDeclaration(&M, Intrinsic::trap), {}, "",
+                     Trap);
+    new UnreachableInst(Ctx, Trap);
+    return Fn;
+  }
+
+  // Makes the module's trap stub print the failing site and, when the
+  // program has one, a sanitizer stack trace, then abort instead of
+  // executing a trap instruction. libFuzzer's -handle_abrt catches the abort
+  // like an ASan report and saves the crashing input.
+  static void lowerTrapStubForFuzzer(Module &M) {
+    auto *Stub = getOrDefineTrapStub(M);
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Trap = &Stub->back();
+    if (!isa<IntrinsicInst>(Trap->front()))
+      return;
+    while (!Trap->empty())
+      Trap->back().eraseFromParent();
+
+    auto *SiteTy = getSiteType(Ctx);
+    auto *site = GetElementPtrInst::Create(
+        SiteTy, M.getNamedGlobal(SiteTableName), {Stub->getArg(0)}, "site",
+        Trap);
+    auto *Format = ConstantDataArray::getString(
+        Ctx, "==vaporeon== ERROR: out-of-bounds write in %s at %s:%u:%u\n");
+    auto *FormatGV = new GlobalVariable(M, Format->getType(), true,
+                                        GlobalValue::PrivateLinkage, Format,
+                                        ".vaporeon.str");
+    FormatGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    // dprintf(STDERR_FILENO, ...)
+    SmallVector<Value *, 6> args = {ConstantInt::get(Int32Ty, 2), FormatGV};
+    for (unsigned i = 0; i < SiteTy->getNumElements(); ++i)
+      args.push_back(new LoadInst(
+          SiteTy->getElementType(i),
+          GetElementPtrInst::Create(SiteTy, site,
+                                    {ConstantInt::get(Int32Ty, 0),
+                                     ConstantInt::get(Int32Ty, i)},
+                                    "", Trap),
+          "", Trap));
+    auto dprintf = M.getOrInsertFunction(
+        "dprintf", FunctionType::get(Int32Ty, {Int32Ty, Ptr}, true));
+    CallInst::Create(dprintf, args, "", Trap);
+
+    auto stackTrace = M.getOrInsertFunction("__sanitizer_print_stack_trace",
+                                            Type::getVoidTy(Ctx));
+    if (auto *Decl = dyn_cast<Function>(stackTrace.getCallee());
+        Decl && Decl->isDeclaration())
+      Decl->setLinkage(GlobalValue::ExternalWeakLinkage);
+    auto *PrintStack = BasicBlock::Create(Ctx, "print_stack", Stub);
+    auto *Abort = BasicBlock::Create(Ctx, "abort", Stub);
+    BranchInst::Create(PrintStack, Abort,
+                       new ICmpInst(*Trap, ICmpInst::ICMP_NE,
+                                    stackTrace.getCallee(),
+                                    ConstantPointerNull::get(Ptr)),
+                       Trap);
+    CallInst::Create(stackTrace, {}, "", PrintStack);
+    BranchInst::Create(Abort, PrintStack);
+    CallInst::Create(M.getOrInsertFunction("abort", Type::getVoidTy(Ctx)), {},
+                     "", Abort)
+        ->setDoesNotReturn();
+    new UnreachableInst(Ctx, Abort);
+  }
+
+  // Bumps siteID's libFuzzer counter before InsertBefore, wrapping like the
+  // counters SanitizerCoverage emits.
+  static void emitCoverageCount(unsigned siteID, Instruction *InsertBefore) {
+    auto &M = *InsertBefore->getModule();
+    auto *Int8Ty = Type::getInt8Ty(M.getContext());
+    auto *counters = cast<GlobalVariable>(
+        M.getOrInsertGlobal(CoverageCountersName, Int8Ty, [&] {
+          auto *CountersTy = ArrayType::get(Int8Ty, 0);
+          return new GlobalVariable(M, CountersTy, false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantAggregateZero::get(CountersTy),
+                                    CoverageCountersName);
+        }));
+    auto *slot = GetElementPtrInst::Create(
+        Int8Ty, counters,
+        {ConstantInt::get(Type::getInt64Ty(M.getContext()), siteID)}, "",
+        InsertBefore);
+    auto *count = new LoadInst(Int8Ty, slot, "", InsertBefore);
+    auto *inc = new StoreInst(
+        BinaryOperator::CreateAdd(count, ConstantInt::get(Int8Ty, 1), "",
+                                  InsertBefore),
+        slot, InsertBefore);
+    for (Instruction *I : {cast<Instruction>(count), cast<Instruction>(inc)})
+      I->setMetadata(LLVMContext::MD_nosanitize,
+                     MDNode::get(M.getContext(), {}));
+  }
+
+  // Grows __vaporeon_cov to one counter per site in the site table, appends
+  // F's sites, numSites of them, to the PC table, and (re)defines the
+  // constructor registering both, so they cover every function instrumented
+  // so far. A site's PC is its function's address: libFuzzer uses it only to
+  // print and symbolize coverage.
+  static void defineCoverage(Function &F, unsigned numSites) {
+    auto &M = *F.getParent();
+    auto &Ctx = M.getContext();
+    auto *Int8Ty = Type::getInt8Ty(Ctx);
+    auto *IntPtrTy = M.getDataLayout().getIntPtrType(Ctx);
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    unsigned totalSites = numTrapSites(M);
+    auto *counters = M.getNamedGlobal(CoverageCountersName);
+    if (!counters)
+      return;
+    if (counters->getValueType()->getArrayNumElements() < totalSites) {
+      auto *CountersTy = ArrayType::get(Int8Ty, totalSites);
+      auto *grown = new GlobalVariable(M, CountersTy, false,
+                                       GlobalValue::InternalLinkage,
+                                       ConstantAggregateZero::get(CountersTy));
+      grown->takeName(counters);
+      counters->replaceAllUsesWith(grown);
+      counters->eraseFromParent();
+      counters = grown;
+    }
+
+    // sites of functions without coverage still need an entry each
+    SmallVector<Constant *, 32> pcs;
+    auto *table = M.getNamedGlobal(CoveragePCsName);
+    if (table)
+      for (unsigned i = 0; i < table->getValueType()->getArrayNumElements();
+           ++i)
+        pcs.push_back(table->getInitializer()->getAggregateElement(i));
+    auto *pc = ConstantExpr::getPtrToInt(&F, IntPtrTy);
+    pcs.resize(2 * (totalSites - numSites), ConstantInt::get(IntPtrTy, 0));
+    for (unsigned i = 0; i < numSites; ++i)
+      pcs.append({pc, ConstantInt::get(IntPtrTy, 0)});
+    auto *PCsTy = ArrayType::get(IntPtrTy, pcs.size());
+    auto *grownPCs = new GlobalVariable(M, PCsTy, true,
+                                        GlobalValue::PrivateLinkage,
+                                        ConstantArray::get(PCsTy, pcs),
+                                        CoveragePCsName);
+    if (table) {
+      grownPCs->takeName(table);
+      table->replaceAllUsesWith(grownPCs);
+      table->eraseFromParent();
+    }
+
+    auto *Fn = M.getFunction(CoverageInitName);
+    if (Fn) {
+      Fn->deleteBody();
+    } else {
+      Fn = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                            GlobalValue::InternalLinkage, CoverageInitName,
+                            M);
+      appendToGlobalCtors(M, Fn, 2);
+    }
+    Fn->setLinkage(GlobalValue::InternalLinkage);
+    auto *BB = BasicBlock::Create(Ctx, "", Fn);
+    // __sanitizer_cov_8bit_counters_init(counters, counters + totalSites)
+    // __sanitizer_cov_pcs_init(pcs, pcs + 2 * totalSites)
+    for (auto [Name, Array] :
+         {std::pair(StringRef("__sanitizer_cov_8bit_counters_init"),
+                    cast<GlobalVariable>(counters)),
+          std::pair(StringRef("__sanitizer_cov_pcs_init"), grownPCs)}) {
+      auto init =
+          M.getOrInsertFunction(Name, Type::getVoidTy(Ctx), Ptr, Ptr);
+      if (auto *Decl = dyn_cast<Function>(init.getCallee());
+          Decl && Decl->isDeclaration())
+        Decl->setLinkage(GlobalValue::ExternalWeakLinkage);
+      auto *Call = BasicBlock::Create(Ctx, "", Fn);
+      auto *Next = BasicBlock::Create(Ctx, "", Fn);
+      BranchInst::Create(Call, Next,
+                         new ICmpInst(*BB, ICmpInst::ICMP_NE,
+                                      init.getCallee(),
+                                      ConstantPointerNull::get(Ptr)),
+                         BB);
+      auto *end = ConstantExpr::getGetElementPtr(
+          Array->getValueType(), Array,
+          ArrayRef<Constant *>{ConstantInt::get(IntPtrTy, 1)});
+      CallInst::Create(init, {Array, end}, "", Call);
+      BranchInst::Create(Next, Call);
+      BB = Next;
+    }
+    ReturnInst::Create(Ctx, BB);
+  }
+
+  // Returns the module's outlined check thunk, defining it on first use. It
+  // runs the same compare as an inline check and calls the trap stub with
+  // the site ID it was passed, so a check site is one call instead of the
+  // compare, branch and block split.
+  static Function *getOrDefineCheckThunk(Module &M, bool limit) {
+    StringRef Name = limit ? LimitCheckThunkName : CheckThunkName;
+    if (auto *Fn = M.getFunction(Name))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Ty = limit ? FunctionType::get(Type::getVoidTy(Ctx),
+                                         {Ptr, Ptr, Int32Ty}, false)
+                     : FunctionType::get(Type::getVoidTy(Ctx),
+                                         {Ptr, Ptr, Type::getInt64Ty(Ctx),
+                                          Int32Ty},
+                                         false);
+    auto *Fn = Function::Create(Ty, GlobalValue::InternalLinkage, Name, M);
+    Fn->addFnAttr(Attribute::NoInline);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Trap = BasicBlock::Create(Ctx, "trap", Fn);
+    auto *InBounds = BasicBlock::Create(Ctx, "in_bounds", Fn);
+    ReturnInst::Create(Ctx, InBounds);
+    CallInst::Create(getOrDefineTrapStub(M), {Fn->getArg(Fn->arg_size() - 1)},
+                     "", Trap)
+        ->setDoesNotReturn();
+    new UnreachableInst(Ctx, Trap);
+
+    auto *br =
+        BranchInst::Create(Trap, InBounds, ConstantInt::getFalse(Ctx), Entry);
+    br->setCondition(
+        limit ? cast<Value>(new ICmpInst(br, ICmpInst::ICMP_UGE,
+                                         Fn->getArg(0), Fn->getArg(1)))
+              : emitOutOfBounds(Fn->getArg(0),
+                                {Fn->getArg(1), Fn->getArg(2)}, br));
+    br->setMetadata(
+        LLVMContext::MD_prof,
+        MDBuilder(Ctx).createBranchWeights(TrapWeight, InBoundsWeight));
+    return Fn;
+  }
+
+  // Returns the module's __vaporeon_audit(site_id), defining it and the
+  // weak, thread-local __vaporeon_first_violation on first use. It is
+  // internal since site IDs index this module's table, but the slot holds a
+  // pointer to the site's entry so all modules can share it.
+  static Function *getOrDefineAuditRecorder(Module &M) {
+    if (auto *Fn = M.getFunction(AuditName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    getOrDefineTrapStub(M);
+    auto *table = M.getNamedGlobal(SiteTableName);
+    auto report = M.getOrInsertFunction(ReportHookName, Type::getVoidTy(Ctx),
+                                        Ptr);
+    auto *first = cast<GlobalVariable>(
+        M.getOrInsertGlobal(FirstViolationName, Ptr));
+    if (first->isDeclaration()) {
+      first->setInitializer(ConstantPointerNull::get(Ptr));
+      first->setLinkage(GlobalValue::WeakAnyLinkage);
+    }
+    first->setThreadLocal(true);
+
+    auto *Fn = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), {Type::getInt32Ty(Ctx)},
+                          false),
+        GlobalValue::InternalLinkage, AuditName, M);
+    Fn->addFnAttr(Attribute::Cold);
+    Fn->addFnAttr(Attribute::NoInline);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    Fn->setSection(".text.unlikely");
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Record = BasicBlock::Create(Ctx, "record", Fn);
+    auto *Report = BasicBlock::Create(Ctx, "report", Fn);
+    auto *Done = BasicBlock::Create(Ctx, "done", Fn);
+    auto *site = GetElementPtrInst::Create(getSiteType(Ctx), table,
+                                           {Fn->getArg(0)}, "site", Entry);
+    auto *isFirst =
+        new ICmpInst(*Entry, ICmpInst::ICMP_EQ, new LoadInst(Ptr, first, "", Entry),
+                     ConstantPointerNull::get(Ptr));
+    BranchInst::Create(Record, Report, isFirst, Entry);
+    new StoreInst(site, first, Record);
+    BranchInst::Create(Report, Record);
+    auto *hasReport = new ICmpInst(*Report, ICmpInst::ICMP_NE,
+                                   report.getCallee(),
+                                   ConstantPointerNull::get(Ptr));
+    auto *Call = BasicBlock::Create(Ctx, "call", Fn, Done);
+    BranchInst::Create(Call, Done, hasReport, Report);
+    CallInst::Create(report, {site}, "", Call);
+    BranchInst::Create(Done, Call);
+    ReturnInst::Create(Ctx, Done);
+    return Fn;
+  }
+
+  // Per-function audit state: whether a check failed since the flag was
+  // last examined, and the first site that failed.
+  struct AuditState {
+    AllocaInst *flag, *site;
+  };
+
+  static AuditState createAuditState(Function &F) {
+    auto &Ctx = F.getContext();
+    auto *InsertPt = &*F.getEntryBlock().getFirstInsertionPt();
+    auto *flag = new AllocaInst(Type::getInt1Ty(Ctx), F.getAddressSpace(),
+                                "violation", InsertPt);
+    auto *site = new AllocaInst(Type::getInt32Ty(Ctx), F.getAddressSpace(),
+                                "violation_site", InsertPt);
+    new StoreInst(ConstantInt::getFalse(Ctx), flag, InsertPt);
+    return {flag, site};
+  }
+
+  // ORs cond into the violation flag before Before, keeping the site of the
+  // first failure. No branch: the site is only meaningful once the flag is
+  // set, so it is overwritten with siteID whenever the flag was still clear.
+  static void emitAuditUpdate(Value *cond, Instruction *Before,
+                              AuditState State, unsigned siteID) {
+    auto &Ctx = Before->getContext();
+    auto *failed =
+        new LoadInst(Type::getInt1Ty(Ctx), State.flag, "failed", Before);
+    new StoreInst(BinaryOperator::CreateOr(failed, cond, "", Before),
+                  State.flag, Before);
+    auto *site = new LoadInst(Type::getInt32Ty(Ctx), State.site, "", Before);
+    new StoreInst(SelectInst::Create(failed, site,
+                                     ConstantInt::get(Type::getInt32Ty(Ctx),
+                                                      siteID),
+                                     "", Before),
+                  State.site, Before);
+  }
+
+  // Splits the block before Before and reports and clears a set violation
+  // flag there.
+  static void emitAuditExamination(Instruction *Before, AuditState State) {
+    auto &Ctx = Before->getContext();
+    auto *failed =
+        new LoadInst(Type::getInt1Ty(Ctx), State.flag, "failed", Before);
+    auto *Head = Before->getParent();
+    auto *Tail = Head->splitBasicBlock(Before);
+    auto *Audit =
+        BasicBlock::Create(Ctx, "audit", Head->getParent(), Tail);
+    CallInst::Create(getOrDefineAuditRecorder(*Head->getModule()),
+                     {new LoadInst(Type::getInt32Ty(Ctx), State.site, "",
+                                   Audit)},
+                     "", Audit);
+    new StoreInst(ConstantInt::getFalse(Ctx), State.flag, Audit);
+    BranchInst::Create(Tail, Audit);
+    auto *br = BranchInst::Create(Audit, Tail, failed);
+    br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(Ctx).createBranchWeights(TrapWeight,
+                                                       InBoundsWeight));
+    ReplaceInstWithInst(Head->getTerminator(), br);
+  }
+
+  // Examines the violation flag at the exits of every loop, before calls
+  // other than intrinsics and the pass's own functions, and before returns.
+  static void emitAuditExaminations(Function &F, AuditState State,
+                                    ArrayRef<StringRef> ownFunctions) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    SmallSetVector<Instruction *, 16> points;
+    for (auto *L : LI.getLoopsInPreorder()) {
+      SmallVector<BasicBlock *, 4> exits;
+      L->getUniqueExitBlocks(exits);
+      for (auto *Exit : exits)
+        points.insert(&*Exit->getFirstInsertionPt());
+    }
+    for (auto &I : instructions(F)) {
+      if (isa<ReturnInst>(I) || isa<ResumeInst>(I)) {
+        // nothing can go between a musttail call and its return
+        if (auto *CI = I.getParent()->getTerminatingMustTailCall())
+          points.insert(CI);
+        else
+          points.insert(&I);
+      } else if (auto *CB = dyn_cast<CallBase>(&I)) {
+        auto *Callee = CB->getCalledFunction();
+        if (!isa<IntrinsicInst>(CB) &&
+            !(Callee && is_contained(ownFunctions, Callee->getName())))
+          points.insert(&I);
+      }
+    }
+    for (auto *I : points)
+      emitAuditExamination(I, State);
+  }
+
+  // Returns the __vaporeon_checks_enabled flag, defining it, initially set,
+  // and __vaporeon_set_checks_enabled(int) unless the module already does.
+  static GlobalVariable *getOrDefineChecksEnabled(Module &M) {
+    auto &Ctx = M.getContext();
+    auto *Int8Ty = Type::getInt8Ty(Ctx);
+    auto *Flag = cast<GlobalVariable>(M.getOrInsertGlobal(ChecksEnabledName, Int8Ty));
+    if (Flag->isDeclaration()) {
+      Flag->setInitializer(ConstantInt::get(Int8Ty, 1));
+      Flag->setLinkage(GlobalValue::WeakAnyLinkage);
+    }
+
+    auto *Fn = cast<Function>(
+        M.getOrInsertFunction(SetChecksEnabledName, Type::getVoidTy(Ctx),
+                              Type::getInt32Ty(Ctx))
+            .getCallee());
+    if (!Fn->isDeclaration())
+      return Flag;
+    Fn->setLinkage(GlobalValue::WeakAnyLinkage);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *enabled =
+        new ICmpInst(*Entry, ICmpInst::ICMP_NE, Fn->getArg(0),
+                     ConstantInt::get(Type::getInt32Ty(Ctx), 0));
+    new StoreInst(new ZExtInst(enabled, Int8Ty, "", Entry), Flag, false,
+                  Align(1), AtomicOrdering::Monotonic, SyncScope::System,
+                  Entry);
+    ReturnInst::Create(Ctx, Entry);
+    return Flag;
+  }
+
+  // Clones F into F.unchecked with every branch to trapBlock or to an audit
+  // block, every outlined check and all sampling removed, and makes F tail
+  // call the clone from its entry unless checks should run: while
+  // __vaporeon_checks_enabled is set if toggle, and on one in samplePeriod
+  // calls per thread if samplePeriod > 1.
+  // The clone keeps F's fat pointer calling convention, so callers need not
+  // know which one runs, and an unchecked call costs a load or two and a
+  // predictable branch.
+  static Function *addUncheckedClone(Function &F, BasicBlock *trapBlock,
+                                     bool toggle, unsigned samplePeriod) {
+    auto &M = *F.getParent();
+    auto &Ctx = F.getContext();
+    ValueToValueMapTy VMap;
+    auto *Clone = CloneFunction(&F, VMap);
+    Clone->setName(F.getName() + ".unchecked");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    Clone->setComdat(nullptr);
+    Clone->addFnAttr(UncheckedAttr);
+
+    auto *cloneTrap = cast<BasicBlock>(VMap[trapBlock]);
+    for (auto *Pred : SmallVector<BasicBlock *, 16>(predecessors(cloneTrap))) {
+      auto *br = cast<BranchInst>(Pred->getTerminator());
+      auto *inBounds = br->getSuccessor(br->getSuccessor(0) == cloneTrap);
+      ReplaceInstWithInst(br, BranchInst::Create(inBounds));
+    }
+    DeleteDeadBlock(cloneTrap);
+    // never take the branch into an audit block
+    SmallVector<BasicBlock *, 8> auditBlocks;
+    for (auto &BB : *Clone)
+      if (any_of(BB, [](Instruction &I) {
+            auto *CI = dyn_cast<CallInst>(&I);
+            return CI && CI->getCalledFunction() &&
+                   CI->getCalledFunction()->getName() == AuditName;
+          }))
+        auditBlocks.push_back(&BB);
+    for (auto *BB : auditBlocks) {
+      auto *br = cast<BranchInst>(BB->getSinglePredecessor()->getTerminator());
+      ReplaceInstWithInst(br, BranchInst::Create(br->getSuccessor(1)));
+      DeleteDeadBlock(BB);
+    }
+    auto *countdown = M.getNamedGlobal(sampleCountdownName(F));
+    auto *counts = M.getNamedGlobal(SampleCountsName);
+    for (auto &I : make_early_inc_range(instructions(Clone))) {
+      if (auto *CI = dyn_cast<CallInst>(&I))
+        if (auto *Callee = CI->getCalledFunction();
+            Callee && (Callee->getName() == CheckThunkName ||
+                       Callee->getName() == LimitCheckThunkName))
+          CI->eraseFromParent();
+      // stop sampling: drop the countdown and count updates and never take
+      // the branch on `countdown == 0` into a sampled block
+      if (!countdown)
+        continue;
+      if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        auto *slot = dyn_cast<GetElementPtrInst>(SI->getPointerOperand());
+        if (SI->getPointerOperand() == countdown ||
+            (slot && slot->getPointerOperand() == counts))
+          SI->eraseFromParent();
+      }
+      if (auto *br = dyn_cast<BranchInst>(&I); br && br->isConditional())
+        if (auto *cmp = dyn_cast<ICmpInst>(br->getCondition()))
+          if (auto *LI = dyn_cast<LoadInst>(cmp->getOperand(0));
+              LI && LI->getPointerOperand() == countdown)
+            ReplaceInstWithInst(br, BranchInst::Create(br->getSuccessor(1)));
+    }
+
+    // keep every alloca in the entry block, ahead of the dispatch
+    auto *Entry = &F.getEntryBlock();
+    auto *SplitPt = &*Entry->getFirstNonPHIOrDbgOrAlloca();
+    for (auto &I : make_early_inc_range(*Entry))
+      if (isa<AllocaInst>(I) && SplitPt->comesBefore(&I))
+        I.moveBefore(SplitPt);
+    auto *Checked = Entry->splitBasicBlock(SplitPt, "checked");
+    auto *Unchecked = BasicBlock::Create(Ctx, "unchecked", &F, Checked);
+    SmallVector<Value *, 4> args(make_pointer_range(F.args()));
+    auto *call = CallInst::Create(Clone, args, "", Unchecked);
+    call->setTailCallKind(CallInst::TCK_MustTail);
+    call->setCallingConv(F.getCallingConv());
+    ReturnInst::Create(Ctx, F.getReturnType()->isVoidTy() ? nullptr : call,
+                       Unchecked);
+
+    auto *InsertPt = Entry->getTerminator();
+    Value *runChecked = nullptr;
+    if (toggle) {
+      auto *enabled = new LoadInst(
+          Type::getInt8Ty(Ctx), getOrDefineChecksEnabled(M), "checks_enabled",
+          false, Align(1), AtomicOrdering::Monotonic, SyncScope::System,
+          InsertPt);
+      runChecked = new ICmpInst(InsertPt, ICmpInst::ICMP_NE, enabled,
+                                ConstantInt::get(Type::getInt8Ty(Ctx), 0));
+    }
+    BasicBlock *Target = Checked;
+    if (samplePeriod > 1) {
+      auto *countdown = getOrDefineSampleState(F);
+      auto *sampled = emitSampleCountdown(countdown, InsertPt);
+      runChecked = runChecked
+                       ? BinaryOperator::CreateAnd(runChecked, sampled, "",
+                                                   InsertPt)
+                       : sampled;
+      Target = BasicBlock::Create(Ctx, "sampled", &F, Checked);
+      CallInst::Create(getOrDefineSampler(M, samplePeriod), {countdown}, "",
+                       Target);
+      BranchInst::Create(Checked, Target);
+    }
+    auto *br = BranchInst::Create(Target, Unchecked, runChecked);
+    if (samplePeriod > 1)
+      br->setMetadata(LLVMContext::MD_prof, MDBuilder(Ctx).createBranchWeights(
+                                                1, samplePeriod - 1));
+    ReplaceInstWithInst(InsertPt, br);
+    return Clone;
+  }
+
+  // Returns the module's __vaporeon_sample(countdown), defining it on first
+  // use. It rearms the given countdown of this thread with a random value in
+  // [period / 2, period * 3 / 2), so sampling does not lock onto one site of
+  // a loop whose sites repeat with a period dividing the sampling period.
+  static Function *getOrDefineSampler(Module &M, unsigned period) {
+    if (auto *Fn = M.getFunction(SamplerName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *seed = M.getNamedGlobal(SampleSeedName);
+    auto *Fn = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), {PointerType::getUnqual(Ctx)},
+                          false),
+        GlobalValue::InternalLinkage, SamplerName, M);
+    Fn->addFnAttr(Attribute::Cold);
+    Fn->addFnAttr(Attribute::NoInline);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    auto *BB = BasicBlock::Create(Ctx, "", Fn);
+    // xorshift32
+    Value *x = new LoadInst(Int32Ty, seed, "", BB);
+    for (auto [op, amount] : {std::pair(Instruction::Shl, 13),
+                              std::pair(Instruction::LShr, 17),
+                              std::pair(Instruction::Shl, 5)})
+      x = BinaryOperator::CreateXor(
+          x,
+          BinaryOperator::Create(op, x, ConstantInt::get(Int32Ty, amount), "",
+                                 BB),
+          "", BB);
+    new StoreInst(x, seed, BB);
+    auto *jitter = BinaryOperator::CreateURem(
+        x, ConstantInt::get(Int32Ty, period), "", BB);
+    new StoreInst(BinaryOperator::CreateAdd(
+                      jitter, ConstantInt::get(Int32Ty, period / 2), "", BB),
+                  Fn->getArg(0), BB);
+    ReturnInst::Create(Ctx, BB);
+    return Fn;
+  }
+
+  static std::string sampleCountdownName(const Function &F) {
+    return (SampleCountdownName + Twine(".") + F.getName()).str();
+  }
+
+  // Returns this thread's sampling countdown for F, defining it, the seed and
+  // the per-site counts on first use. Each function counts its own calls, so
+  // a hot function cannot keep a cold one from ever being sampled.
+  static GlobalVariable *getOrDefineSampleState(Function &F) {
+    auto &M = *F.getParent();
+    auto &Ctx = M.getContext();
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto getOrDefineThreadLocal = [&](StringRef Name, uint32_t Init) {
+      return cast<GlobalVariable>(M.getOrInsertGlobal(Name, Int32Ty, [&] {
+        auto *GV = new GlobalVariable(M, Int32Ty, false,
+                                      GlobalValue::InternalLinkage,
+                                      ConstantInt::get(Int32Ty, Init), Name);
+        GV->setThreadLocal(true);
+        return GV;
+      }));
+    };
+    // the first check or call a thread executes is sampled
+    auto *countdown = getOrDefineThreadLocal(sampleCountdownName(F), 0);
+    getOrDefineThreadLocal(SampleSeedName, 2463534242u);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    M.getOrInsertGlobal(SampleCountsName, Int64Ty, [&] {
+      auto *CountsTy = ArrayType::get(Int64Ty, 0);
+      return new GlobalVariable(M, CountsTy, false,
+                                GlobalValue::InternalLinkage,
+                                ConstantAggregateZero::get(CountsTy),
+                                SampleCountsName);
+    });
+    return countdown;
+  }
+
+  // Emits `countdown-- == 0` on this thread's sampling countdown before
+  // InsertBefore.
+  static Value *emitSampleCountdown(GlobalVariable *countdown,
+                                    Instruction *InsertBefore) {
+    auto *Int32Ty = Type::getInt32Ty(InsertBefore->getContext());
+    auto *left = new LoadInst(Int32Ty, countdown, "", InsertBefore);
+    new StoreInst(
+        BinaryOperator::CreateSub(left, ConstantInt::get(Int32Ty, 1), "",
+                                  InsertBefore),
+        countdown, InsertBefore);
+    return new ICmpInst(InsertBefore, ICmpInst::ICMP_EQ, left,
+                        ConstantInt::get(Int32Ty, 0), "sampled");
+  }
+
+  // Splits the block before Before and, when this thread's countdown for the
+  // function runs out, branches to a block that rearms it. Returns that
+  // block's terminator, before which the check goes.
+  static Instruction *emitSampleBranch(Instruction *Before, unsigned period) {
+    auto &M = *Before->getModule();
+    auto &Ctx = M.getContext();
+    auto *countdown = getOrDefineSampleState(*Before->getFunction());
+    auto *sampled = emitSampleCountdown(countdown, Before);
+    auto *new_origBB = Before->getParent()->splitBasicBlockBefore(Before, "");
+    auto *orig = new_origBB->getSingleSuccessor();
+    auto *SampledBB =
+        BasicBlock::Create(Ctx, "sampled", orig->getParent(), orig);
+    CallInst::Create(getOrDefineSampler(M, period), {countdown}, "",
+                     SampledBB);
+    auto *term = BranchInst::Create(orig, SampledBB);
+    auto *br = BranchInst::Create(SampledBB, orig, sampled);
+    br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(Ctx).createBranchWeights(1, period - 1));
+    ReplaceInstWithInst(new_origBB->getTerminator(), br);
+    return term;
+  }
+
+  // Counts an execution of siteID in __vaporeon_samples before InsertBefore.
+  static void emitSampleCount(unsigned siteID, Instruction *InsertBefore) {
+    auto &M = *InsertBefore->getModule();
+    auto *Int64Ty = Type::getInt64Ty(M.getContext());
+    getOrDefineSampleState(*InsertBefore->getFunction());
+    auto *slot = GetElementPtrInst::Create(
+        Int64Ty, M.getNamedGlobal(SampleCountsName),
+        {ConstantInt::get(Int64Ty, siteID)}, "", InsertBefore);
+    auto *count = new LoadInst(Int64Ty, slot, "", InsertBefore);
+    new StoreInst(BinaryOperator::CreateAdd(
+                      count, ConstantInt::get(Int64Ty, 1), "", InsertBefore),
+                  slot, InsertBefore);
+  }
+
+  // Grows __vaporeon_samples to one counter per site in the site table and
+  // (re)defines the destructor that reports the sampled sites, so both cover
+  // every function instrumented so far.
+  static void defineSampleReport(Module &M) {
+    auto &Ctx = M.getContext();
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    unsigned numSites = numTrapSites(M);
+    auto *counts = M.getNamedGlobal(SampleCountsName);
+    if (!counts || !numSites)
+      return;
+    if (counts->getValueType()->getArrayNumElements() < numSites) {
+      auto *CountsTy = ArrayType::get(Int64Ty, numSites);
+      auto *grown = new GlobalVariable(M, CountsTy, false,
+                                       GlobalValue::InternalLinkage,
+                                       ConstantAggregateZero::get(CountsTy));
+      grown->takeName(counts);
+      counts->replaceAllUsesWith(grown);
+      counts->eraseFromParent();
+      counts = grown;
+    }
+
+    auto *Fn = M.getFunction(SampleReporterName);
+    if (Fn) {
+      Fn->deleteBody();
+    } else {
+      Fn = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                            GlobalValue::InternalLinkage, SampleReporterName,
+                            M);
+      appendToGlobalDtors(M, Fn, 0);
+    }
+    Fn->setLinkage(GlobalValue::InternalLinkage);
+    Fn->addFnAttr(Attribute::Cold);
+    auto hook = M.getOrInsertFunction(SampleReportHookName,
+                                      Type::getVoidTy(Ctx), Ptr, Int64Ty);
+    if (auto *Decl = dyn_cast<Function>(hook.getCallee());
+        Decl && Decl->isDeclaration())
+      Decl->setLinkage(GlobalValue::ExternalWeakLinkage);
+
+    // for (i = 0; i < numSites; ++i)
+    //   if (counts[i]) __vaporeon_sample_report(&sites[i], counts[i]);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Loop = BasicBlock::Create(Ctx, "loop", Fn);
+    auto *Report = BasicBlock::Create(Ctx, "report", Fn);
+    auto *Next = BasicBlock::Create(Ctx, "next", Fn);
+    auto *Exit = BasicBlock::Create(Ctx, "exit", Fn);
+    BranchInst::Create(Loop, Exit,
+                       new ICmpInst(*Entry, ICmpInst::ICMP_NE,
+                                    hook.getCallee(),
+                                    ConstantPointerNull::get(Ptr)),
+                       Entry);
+    auto *i = PHINode::Create(Int64Ty, 2, "i", Loop);
+    i->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+    auto *count = new LoadInst(
+        Int64Ty, GetElementPtrInst::Create(Int64Ty, counts, {i}, "", Loop), "",
+        Loop);
+    BranchInst::Create(Report, Next,
+                       new ICmpInst(*Loop, ICmpInst::ICMP_NE, count,
+                                    ConstantInt::get(Int64Ty, 0)),
+                       Loop);
+    auto *site = GetElementPtrInst::Create(getSiteType(Ctx),
+                                           M.getNamedGlobal(SiteTableName),
+                                           {i}, "site", Report);
+    CallInst::Create(hook, {site, count}, "", Report);
+    BranchInst::Create(Next, Report);
+    auto *inc = BinaryOperator::CreateAdd(i, ConstantInt::get(Int64Ty, 1), "",
+                                          Next);
+    i->addIncoming(inc, Next);
+    BranchInst::Create(Exit, Loop,
+                       new ICmpInst(*Next, ICmpInst::ICMP_EQ, inc,
+                                    ConstantInt::get(Int64Ty, numSites)),
+                       Next);
+    ReturnInst::Create(Ctx, Exit);
+  }
+
+  static StructType *getGuardedSlotType(LLVMContext &Ctx) {
+    return StructType::get(Ctx, {PointerType::getUnqual(Ctx),
+                                 Type::getInt32Ty(Ctx), Type::getInt64Ty(Ctx)});
+  }
+
+  // Emits `(bytes + page - 1) & -page` and the page size into BB.
+  static std::pair<Value *, Value *> emitPageRound(Module &M, Value *bytes,
+                                                   BasicBlock *BB) {
+    auto &Ctx = M.getContext();
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto getpagesize = M.getOrInsertFunction("getpagesize",
+                                             Type::getInt32Ty(Ctx));
+    auto *page = new ZExtInst(CallInst::Create(getpagesize, {}, "", BB),
+                              Int64Ty, "page", BB);
+    auto *last = BinaryOperator::CreateAdd(
+        bytes,
+        BinaryOperator::CreateSub(page, ConstantInt::get(Int64Ty, 1), "", BB),
+        "", BB);
+    auto *rounded = BinaryOperator::CreateAnd(
+        last, BinaryOperator::CreateNeg(page, "", BB), "", BB);
+    return {rounded, page};
+  }
+
+  // Returns the module's __vaporeon_guarded_alloc, defining it on first use.
+  // It reuses the slot's cached buffer unless it is in use, and otherwise
+  // maps size bytes rounded up to pages plus a PROT_NONE page and returns
+  // the size bytes just below that page. If the slot is empty the buffer is
+  // cached there and released when the thread exits. Weak, so modules share
+  // one copy.
+  static Function *getOrDefineGuardedAlloc(Module &M) {
+    if (auto *Fn = M.getFunction(GuardedAllocName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *SlotTy = getGuardedSlotType(Ctx);
+    auto *Fn = Function::Create(
+        FunctionType::get(Ptr, {Ptr, Int64Ty}, false),
+        GlobalValue::WeakAnyLinkage, GuardedAllocName, M);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    Fn->addFnAttr(Attribute::NoInline);
+    auto *slot = Fn->getArg(0), *size = Fn->getArg(1);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Reuse = BasicBlock::Create(Ctx, "reuse", Fn);
+    auto *Map = BasicBlock::Create(Ctx, "map", Fn);
+    auto *Fail = BasicBlock::Create(Ctx, "fail", Fn);
+    auto *Protect = BasicBlock::Create(Ctx, "protect", Fn);
+    auto *Cache = BasicBlock::Create(Ctx, "cache", Fn);
+    auto *Done = BasicBlock::Create(Ctx, "done", Fn);
+
+    auto *bufferSlot = GetElementPtrInst::Create(
+        SlotTy, slot, {ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, 0)},
+        "", Entry);
+    auto *busySlot = GetElementPtrInst::Create(
+        SlotTy, slot, {ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, 1)},
+        "", Entry);
+    auto *cached = new LoadInst(Ptr, bufferSlot, "cached", Entry);
+    auto *busy = new LoadInst(Int32Ty, busySlot, "busy", Entry);
+    auto *isCached = new ICmpInst(*Entry, ICmpInst::ICMP_NE, cached,
+                                  ConstantPointerNull::get(Ptr));
+    auto *isFree = new ICmpInst(*Entry, ICmpInst::ICMP_EQ, busy,
+                                ConstantInt::get(Int32Ty, 0));
+    BranchInst::Create(Reuse, Map,
+                       BinaryOperator::CreateAnd(isCached, isFree, "", Entry),
+                       Entry);
+
+    new StoreInst(ConstantInt::get(Int32Ty, 1), busySlot, Reuse);
+    ReturnInst::Create(Ctx, cached, Reuse);
+
+    // PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+    auto [rounded, page] = emitPageRound(M, size, Map);
+    auto mmap = M.getOrInsertFunction("mmap", Ptr, Ptr, Int64Ty, Int32Ty,
+                                      Int32Ty, Int32Ty, Int64Ty);
+    auto *region = CallInst::Create(
+        mmap,
+        {ConstantPointerNull::get(Ptr),
+         BinaryOperator::CreateAdd(rounded, page, "", Map),
+         ConstantInt::get(Int32Ty, 3), ConstantInt::get(Int32Ty, 0x4022),
+         ConstantInt::get(Int32Ty, -1), ConstantInt::get(Int64Ty, 0)},
+        "region", Map);
+    auto *failed = new ICmpInst(
+        *Map, ICmpInst::ICMP_EQ, region,
+        ConstantExpr::getIntToPtr(ConstantInt::get(Int64Ty, -1), Ptr));
+    BranchInst::Create(Fail, Protect, failed, Map);
+
+    CallInst::Create(Intrinsic::getDeclaration(&M, Intrinsic::trap), {}, "",
+                     Fail);
+    new UnreachableInst(Ctx, Fail);
+
+    auto *Int8Ty = Type::getInt8Ty(Ctx);
+    auto *guard =
+        GetElementPtrInst::Create(Int8Ty, region, {rounded}, "guard", Protect);
+    auto mprotect =
+        M.getOrInsertFunction("mprotect", Int32Ty, Ptr, Int64Ty, Int32Ty);
+    CallInst::Create(mprotect, {guard, page, ConstantInt::get(Int32Ty, 0)}, "",
+                     Protect);
+    auto *buffer = GetElementPtrInst::Create(
+        Int8Ty, guard, {BinaryOperator::CreateNeg(size, "", Protect)},
+        "buffer", Protect);
+    BranchInst::Create(Done, Cache, isCached, Protect);
+
+    new StoreInst(buffer, bufferSlot, Cache);
+    new StoreInst(ConstantInt::get(Int32Ty, 1), busySlot, Cache);
+    new StoreInst(size,
+                  GetElementPtrInst::Create(SlotTy, slot,
+                                            {ConstantInt::get(Int32Ty, 0),
+                                             ConstantInt::get(Int32Ty, 2)},
+                                            "", Cache),
+                  Cache);
+    // the C++ ABI's thread_local destructor hook, provided by glibc
+    auto threadAtExit = M.getOrInsertFunction("__cxa_thread_atexit_impl",
+                                              Int32Ty, Ptr, Ptr, Ptr);
+    auto *dsoHandle = cast<GlobalVariable>(
+        M.getOrInsertGlobal("__dso_handle", Type::getInt8Ty(Ctx)));
+    if (dsoHandle->isDeclaration())
+      dsoHandle->setVisibility(GlobalValue::HiddenVisibility);
+    CallInst::Create(threadAtExit,
+                     {getOrDefineGuardedExit(M), slot, dsoHandle}, "", Cache);
+    BranchInst::Create(Done, Cache);
+
+    ReturnInst::Create(Ctx, buffer, Done);
+    return Fn;
+  }
+
+  // Returns the module's __vaporeon_guarded_free, defining it on first use.
+  // The slot's cached buffer is only marked free; any other buffer is
+  // unmapped with its guard page.
+  static Function *getOrDefineGuardedFree(Module &M) {
+    if (auto *Fn = M.getFunction(GuardedFreeName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *SlotTy = getGuardedSlotType(Ctx);
+    auto *Fn = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), {Ptr, Ptr, Int64Ty}, false),
+        GlobalValue::WeakAnyLinkage, GuardedFreeName, M);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    Fn->addFnAttr(Attribute::NoInline);
+    auto *slot = Fn->getArg(0), *buffer = Fn->getArg(1),
+         *size = Fn->getArg(2);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Release = BasicBlock::Create(Ctx, "release", Fn);
+    auto *Unmap = BasicBlock::Create(Ctx, "unmap", Fn);
+
+    auto *cached = new LoadInst(Ptr, slot, "cached", Entry);
+    BranchInst::Create(
+        Release, Unmap,
+        new ICmpInst(*Entry, ICmpInst::ICMP_EQ, buffer, cached), Entry);
+
+    new StoreInst(ConstantInt::get(Int32Ty, 0),
+                  GetElementPtrInst::Create(SlotTy, slot,
+                                            {ConstantInt::get(Int32Ty, 0),
+                                             ConstantInt::get(Int32Ty, 1)},
+                                            "", Release),
+                  Release);
+    ReturnInst::Create(Ctx, Release);
+
+    auto [rounded, page] = emitPageRound(M, size, Unmap);
+    auto *Int8Ty = Type::getInt8Ty(Ctx);
+    auto *guard = GetElementPtrInst::Create(Int8Ty, buffer, {size}, "", Unmap);
+    auto *region = GetElementPtrInst::Create(
+        Int8Ty, guard, {BinaryOperator::CreateNeg(rounded, "", Unmap)},
+        "region", Unmap);
+    auto munmap = M.getOrInsertFunction("munmap", Int32Ty, Ptr, Int64Ty);
+    CallInst::Create(
+        munmap, {region, BinaryOperator::CreateAdd(rounded, page, "", Unmap)},
+        "", Unmap);
+    ReturnInst::Create(Ctx, Unmap);
+    return Fn;
+  }
+
+  // Returns the module's __vaporeon_guarded_exit, defining it on first use.
+  // It empties the slot and unmaps the buffer that was cached there. Weak,
+  // so modules share one copy.
+  static Function *getOrDefineGuardedExit(Module &M) {
+    if (auto *Fn = M.getFunction(GuardedExitName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *SlotTy = getGuardedSlotType(Ctx);
+    auto *Fn = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), {Ptr}, false),
+        GlobalValue::WeakAnyLinkage, GuardedExitName, M);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    auto *slot = Fn->getArg(0);
+    auto *BB = BasicBlock::Create(Ctx, "", Fn);
+    auto *cached = new LoadInst(Ptr, slot, "cached", BB);
+    auto *size = new LoadInst(
+        Int64Ty,
+        GetElementPtrInst::Create(SlotTy, slot,
+                                  {ConstantInt::get(Int32Ty, 0),
+                                   ConstantInt::get(Int32Ty, 2)},
+                                  "", BB),
+        "size", BB);
+    // once the slot no longer holds it, __vaporeon_guarded_free unmaps it
+    new StoreInst(ConstantPointerNull::get(Ptr), slot, BB);
+    CallInst::Create(getOrDefineGuardedFree(M), {slot, cached, size}, "", BB);
+    ReturnInst::Create(Ctx, BB);
+    return Fn;
+  }
+
+  // Replaces the static alloca AI with a buffer of the same size and
+  // alignment that ends at a guard page. Returns the call that allocates it,
+  // which releaseGuardedBuffer pairs with its frees.
+  static CallInst *moveToGuardedBuffer(AllocaInst *AI) {
+    auto &F = *AI->getFunction();
+    auto &M = *F.getParent();
+    auto &Ctx = M.getContext();
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    // the end abuts the guard page, so the size is padded to keep the start
+    // aligned
+    uint64_t bytes = alignTo(
+        M.getDataLayout().getTypeAllocSize(AI->getAllocatedType()),
+        AI->getAlign());
+    auto *SlotTy = getGuardedSlotType(Ctx);
+    auto *slot = new GlobalVariable(M, SlotTy, false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantAggregateZero::get(SlotTy),
+                                    F.getName() + "." + AI->getName() +
+                                        ".guarded_slot");
+    slot->setThreadLocal(true);
+    auto *size = ConstantInt::get(Int64Ty, bytes);
+    auto *buffer = CallInst::Create(getOrDefineGuardedAlloc(M), {slot, size},
+                                    "", AI);
+    buffer->takeName(AI);
+    buffer->addRetAttr(Attribute::NoAlias);
+    buffer->addRetAttr(Attribute::getWithAlignment(Ctx, AI->getAlign()));
+    AI->replaceAllUsesWith(buffer);
+    AI->eraseFromParent();
+    return buffer;
+  }
+
+  // Frees the guarded buffer allocated by Alloc before every return.
+  static void releaseGuardedBuffer(CallInst *Alloc) {
+    auto &F = *Alloc->getFunction();
+    auto *Free = getOrDefineGuardedFree(*F.getParent());
+    for (auto &BB : F)
+      if (isa<ReturnInst>(BB.getTerminator()) ||
+          isa<ResumeInst>(BB.getTerminator()))
+        CallInst::Create(Free,
+                         {Alloc->getArgOperand(0), Alloc,
+                          Alloc->getArgOperand(1)},
+                         "", BB.getTerminator());
+  }
+
+  static StructType *getShadowEntryType(LLVMContext &Ctx) {
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    return StructType::get(Ctx, {Ptr, Ptr, Type::getInt64Ty(Ctx)});
+  }
+
+  // Returns the module's __vaporeon_shadow_map(), defining it and the weak
+  // __vaporeon_shadow on first use. It reserves the table with
+  // MAP_NORESERVE, so only pages holding written entries are ever backed,
+  // and publishes it with a compare-and-swap. A thread that loses the race
+  // unmaps its copy and returns the winner's. Weak, so modules share one
+  // table.
+  static Function *getOrDefineShadowMap(Module &M) {
+    if (auto *Fn = M.getFunction(ShadowMapName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *table =
+        cast<GlobalVariable>(M.getOrInsertGlobal(ShadowTableName, Ptr));
+    if (table->isDeclaration()) {
+      table->setInitializer(ConstantPointerNull::get(Ptr));
+      table->setLinkage(GlobalValue::WeakAnyLinkage);
+    }
+    auto *Fn = Function::Create(FunctionType::get(Ptr, false),
+                                GlobalValue::WeakAnyLinkage, ShadowMapName, M);
+    Fn->addFnAttr(Attribute::Cold);
+    Fn->addFnAttr(Attribute::NoInline);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Fail = BasicBlock::Create(Ctx, "fail", Fn);
+    auto *Publish = BasicBlock::Create(Ctx, "publish", Fn);
+    auto *Won = BasicBlock::Create(Ctx, "won", Fn);
+    auto *Lost = BasicBlock::Create(Ctx, "lost", Fn);
+
+    // PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+    auto *bytes = ConstantInt::get(
+        Int64Ty, M.getDataLayout().getTypeAllocSize(getShadowEntryType(Ctx)) *
+                     (uint64_t(1) << ShadowIndexBits));
+    auto mmap = M.getOrInsertFunction("mmap", Ptr, Ptr, Int64Ty, Int32Ty,
+                                      Int32Ty, Int32Ty, Int64Ty);
+    auto *region = CallInst::Create(
+        mmap,
+        {ConstantPointerNull::get(Ptr), bytes, ConstantInt::get(Int32Ty, 3),
+         ConstantInt::get(Int32Ty, 0x4022), ConstantInt::get(Int32Ty, -1),
+         ConstantInt::get(Int64Ty, 0)},
+        "region", Entry);
+    auto *failed = new ICmpInst(
+        *Entry, ICmpInst::ICMP_EQ, region,
+        ConstantExpr::getIntToPtr(ConstantInt::get(Int64Ty, -1), Ptr));
+    BranchInst::Create(Fail, Publish, failed, Entry);
+
+    CallInst::Create(Intrinsic::getDeclaration(&M, Intrinsic::trap), {}, "",
+                     Fail);
+    new UnreachableInst(Ctx, Fail);
+
+    auto *swap = new AtomicCmpXchgInst(
+        table, ConstantPointerNull::get(Ptr), region,
+        M.getDataLayout().getPointerABIAlignment(0),
+        AtomicOrdering::AcquireRelease, AtomicOrdering::Acquire,
+        SyncScope::System, Publish);
+    BranchInst::Create(Won, Lost,
+                       ExtractValueInst::Create(swap, {1}, "", Publish),
+                       Publish);
+
+    ReturnInst::Create(Ctx, region, Won);
+
+    auto munmap = M.getOrInsertFunction("munmap", Int32Ty, Ptr, Int64Ty);
+    CallInst::Create(munmap, {region, bytes}, "", Lost);
+    ReturnInst::Create(Ctx, ExtractValueInst::Create(swap, {0}, "", Lost),
+                       Lost);
+    return Fn;
+  }
+
+  // Returns the module's __vaporeon_shadow_entry(addr), defining it on first
+  // use. Always inlined, so once the table exists a lookup costs a load of
+  // its base, a shift, a mask and an add, with no hashing or locking.
+  static Function *getOrDefineShadowEntry(Module &M) {
+    if (auto *Fn = M.getFunction(ShadowEntryName))
+      return Fn;
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *map = getOrDefineShadowMap(M);
+    auto *Fn = Function::Create(FunctionType::get(Ptr, {Ptr}, false),
+                                GlobalValue::InternalLinkage, ShadowEntryName,
+                                M);
+    Fn->addFnAttr(Attribute::AlwaysInline);
+    Fn->addFnAttr(Attribute::NoUnwind);
+    auto *Entry = BasicBlock::Create(Ctx, "", Fn);
+    auto *Map = BasicBlock::Create(Ctx, "map", Fn);
+    auto *Index = BasicBlock::Create(Ctx, "index", Fn);
+
+    auto *base = new LoadInst(Ptr, M.getNamedGlobal(ShadowTableName), "base",
+                              false, M.getDataLayout().getPointerABIAlignment(0),
+                              AtomicOrdering::Monotonic, SyncScope::System,
+                              Entry);
+    auto *br = BranchInst::Create(
+        Map, Index,
+        new ICmpInst(*Entry, ICmpInst::ICMP_EQ, base,
+                     ConstantPointerNull::get(Ptr)),
+        Entry);
+    br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(Ctx).createBranchWeights(TrapWeight,
+                                                       InBoundsWeight));
+
+    auto *mapped = CallInst::Create(map, {}, "mapped", Map);
+    BranchInst::Create(Index, Map);
+
+    auto *table = PHINode::Create(Ptr, 2, "table", Index);
+    table->addIncoming(base, Entry);
+    table->addIncoming(mapped, Map);
+    auto *addr = new PtrToIntInst(Fn->getArg(0), Int64Ty, "", Index);
+    auto *slot = BinaryOperator::CreateAnd(
+        BinaryOperator::CreateLShr(addr, ConstantInt::get(Int64Ty, 3), "",
+                                   Index),
+        ConstantInt::get(Int64Ty, (uint64_t(1) << ShadowIndexBits) - 1), "",
+        Index);
+    ReturnInst::Create(Ctx,
+                       GetElementPtrInst::Create(getShadowEntryType(Ctx),
+                                                 table, {slot}, "", Index),
+                       Index);
+    return Fn;
+  }
+
+  // Returns a location for an inlinable call next to At: At's own, or line 0
+  // of its function, since such calls need one when the function has debug
+  // info.
+  static DebugLoc getInlinableCallLoc(Instruction *At) {
+    if (At->getDebugLoc())
+      return At->getDebugLoc();
+    if (auto *SP = At->getFunction()->getSubprogram())
+      return DILocation::get(At->getContext(), 0, 0, SP);
+    return {};
+  }
+
+  // Emits a GEP to field Field of the shadow entry Entry before InsertBefore.
+  static Instruction *emitShadowField(Value *Entry, unsigned Field,
+                                      Instruction *InsertBefore) {
+    auto *Int32Ty = Type::getInt32Ty(InsertBefore->getContext());
+    return GetElementPtrInst::Create(
+        getShadowEntryType(InsertBefore->getContext()), Entry,
+        {ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, Field)}, "",
+        InsertBefore);
+  }
+
+  // Looks up the bounds shadowed for the pointer LI loads, right after it.
+  // The key is read before and after the bounds, seqlock style, and the
+  // bounds are used only if both reads saw the loaded pointer. Otherwise the
+  // entry belongs to another address, went stale or is being rewritten, and
+  // the pointer gets bounds no check can fail. Returns the bounds and
+  // appends the lookup's instructions to Lookups.
+  static FatPointer
+  emitShadowLoad(LoadInst *LI,
+                 std::vector<SmallVector<WeakVH, 16>> &Lookups) {
+    auto &M = *LI->getModule();
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *InsertBefore = LI->getNextNode();
+    auto *entry = CallInst::Create(getOrDefineShadowEntry(M),
+                                   {LI->getPointerOperand()}, "shadow",
+                                   InsertBefore);
+    entry->setDebugLoc(getInlinableCallLoc(LI));
+    auto loadField = [&](Type *Ty, unsigned Field, AtomicOrdering Order,
+                         const Twine &Name) {
+      auto *Load = new LoadInst(Ty, emitShadowField(entry, Field, InsertBefore),
+                                Name, InsertBefore);
+      // the table is page aligned and every field 8 byte aligned
+      Load->setAlignment(Align(8));
+      Load->setAtomic(Order);
+      return Load;
+    };
+    auto *key = loadField(Ptr, 0, AtomicOrdering::Acquire, "shadow_key");
+    auto *lower =
+        loadField(Ptr, 1, AtomicOrdering::Monotonic, "shadow_lower");
+    auto *size =
+        loadField(Int64Ty, 2, AtomicOrdering::Monotonic, "shadow_size");
+    new FenceInst(Ctx, AtomicOrdering::Acquire, SyncScope::System,
+                  InsertBefore);
+    auto *rekey = loadField(Ptr, 0, AtomicOrdering::Monotonic, "shadow_rekey");
+    auto *hit = BinaryOperator::CreateAnd(
+        new ICmpInst(InsertBefore, ICmpInst::ICMP_EQ, key, LI),
+        new ICmpInst(InsertBefore, ICmpInst::ICMP_EQ, rekey, LI), "shadow_hit",
+        InsertBefore);
+    auto *hitLower = SelectInst::Create(hit, lower, ConstantPointerNull::get(Ptr),
+                                        "", InsertBefore);
+    auto *hitSize = SelectInst::Create(
+        hit, size, ConstantInt::getAllOnesValue(Int64Ty), "", InsertBefore);
+    auto &Lookup = Lookups.emplace_back();
+    for (Instruction *I = entry; I != InsertBefore; I = I->getNextNode())
+      Lookup.push_back(I);
+    return {hitLower, hitSize};
+  }
+
+  // Shadows the pointer SI stores, before it. With Bounds, the key is
+  // cleared before the bounds are written and set to the pointer after, so
+  // a concurrent lookup of the entry misses rather than pairing the key with
+  // another pointer's bounds. Without, the key is set to a value no pointer
+  // loaded will match. Returns the stores it emits.
+  static SmallVector<StoreInst *, 4> emitShadowStore(StoreInst *SI,
+                                                     const FatPointer *Bounds) {
+    auto &M = *SI->getModule();
+    auto &Ctx = M.getContext();
+    auto *Ptr = PointerType::getUnqual(Ctx);
+    auto *entry = CallInst::Create(getOrDefineShadowEntry(M),
+                                   {SI->getPointerOperand()}, "shadow", SI);
+    entry->setDebugLoc(getInlinableCallLoc(SI));
+    auto storeField = [&](Value *V, unsigned Field, AtomicOrdering Order) {
+      auto *Store = new StoreInst(V, emitShadowField(entry, Field, SI), SI);
+      Store->setAlignment(Align(8));
+      Store->setAtomic(Order);
+      return Store;
+    };
+    if (!Bounds)
+      return {storeField(
+          ConstantExpr::getIntToPtr(
+              ConstantInt::getAllOnesValue(Type::getInt64Ty(Ctx)), Ptr),
+          0, AtomicOrdering::Monotonic)};
+    auto *clear =
+        storeField(ConstantPointerNull::get(Ptr), 0, AtomicOrdering::Monotonic);
+    new FenceInst(Ctx, AtomicOrdering::Release, SyncScope::System, SI);
+    return {clear, storeField(Bounds->lower, 1, AtomicOrdering::Monotonic),
+            storeField(Bounds->size, 2, AtomicOrdering::Monotonic),
+            storeField(SI->getValueOperand(), 0, AtomicOrdering::Release)};
+  }
+
+  // Returns where I can go to run as late as possible without running more
+  // often: before its first use in the nearest common dominator of its uses,
+  // or the preheader of the outermost loop containing that block.
+  static Instruction *findLatePlacement(Instruction *I, DominatorTree &DT,
+                                        LoopInfo &LI) {
+    BasicBlock *BB = nullptr;
+    for (auto &U : I->uses()) {
+      auto *UserBB = cast<Instruction>(U.getUser())->getParent();
+      if (auto *PN = dyn_cast<PHINode>(U.getUser()))
+        UserBB = PN->getIncomingBlock(U);
+      BB = BB ? DT.findNearestCommonDominator(BB, UserBB) : UserBB;
+    }
+    if (auto *L = LI.getLoopFor(BB)) {
+      while (L->getParentLoop())
+        L = L->getParentLoop();
+      BB = L->getLoopPreheader()
+               ? L->getLoopPreheader()
+               : DT.getNode(L->getHeader())->getIDom()->getBlock();
+    }
+    for (auto &J : *BB)
+      if (!isa<PHINode>(J) && is_contained(J.operands(), I))
+        return &J;
+    return BB->getTerminator();
+  }
+
+  // Hoists each store of packStores, and its address, to the preheader of
+  // the outermost loop in which its value is invariant and which, by
+  // MemorySSA, holds no other write that may clobber its slot. Instrumented
+  // callees are marked as only reading their fat pointers, so the calls
+  // reading the slot do not count. A slot is private to its call, so
+  // storing to it when the loop does not run is harmless. Returns the number
+  // of stores hoisted.
+  static int hoistPackStores(ArrayRef<StoreInst *> packStores, MemorySSA &MSSA,
+                             AAResults &AA, LoopInfo &LI) {
+    SmallVector<std::pair<StoreInst *, BasicBlock *>, 8> moves;
+    for (auto *SI : packStores) {
+      auto Loc = MemoryLocation::get(SI);
+      auto clobbersSlot = [&](BasicBlock *BB) {
+        auto *Defs = MSSA.getBlockDefs(BB);
+        return Defs && any_of(*Defs, [&](const MemoryAccess &MA) {
+                 auto *Def = dyn_cast<MemoryDef>(&MA);
+                 return Def && Def->getMemoryInst() != SI &&
+                        isModSet(AA.getModRefInfo(Def->getMemoryInst(), Loc));
+               });
+      };
+      BasicBlock *Preheader = nullptr;
+      for (auto *L = LI.getLoopFor(SI->getParent()); L;
+           L = L->getParentLoop()) {
+        if (!L->getLoopPreheader() ||
+            !L->isLoopInvariant(SI->getValueOperand()) ||
+            any_of(L->blocks(), clobbersSlot))
+          break;
+        Preheader = L->getLoopPreheader();
+      }
+      if (Preheader)
+        moves.push_back({SI, Preheader});
+    }
+    for (auto [SI, Preheader] : moves) {
+      cast<Instruction>(SI->getPointerOperand())
+          ->moveBefore(Preheader->getTerminator());
+      SI->moveBefore(Preheader->getTerminator());
+    }
+    return moves.size();
+  }
+
+  // Creates empty lower and size phis at the top of PN's block, to carry
+  // the bounds of the pointer phi PN.
+  static FatPointer createBoundsPhis(PHINode *PN, Type *lowerTy) {
+    auto *InsertPt = PN->getParent()->getFirstNonPHI();
+    unsigned preds = PN->getNumIncomingValues();
+    return {PHINode::Create(lowerTy, preds, "lower", InsertPt),
+            PHINode::Create(Type::getInt64Ty(PN->getContext()), preds, "size",
+                            InsertPt)};
+  }
+
+  // Fills in the bounds phis of pointerPhis, one incoming value per
+  // predecessor, then removes every phi whose incoming values are all the
+  // same value or the phi itself (Braun et al., "Simple and Efficient
+  // Construction of Static Single Assignment Form"), replacing it with that
+  // value. Bounds that agree on every path, such as the constant size and
+  // alloca base of a pointer walking one buffer, then reach the checks
+  // directly instead of through a phi. A pointer coming in without bounds,
+  // e.g. null, gets bounds covering all memory. Updates bounds to refer to
+  // the replacements and returns the number of phis kept.
+  static int resolveBoundsPhis(ArrayRef<PHINode *> pointerPhis,
+                               DenseMap<Value *, FatPointer> &bounds) {
+    auto &Ctx = pointerPhis.front()->getContext();
+    SmallVector<PHINode *, 16> worklist;
+    for (auto *PN : pointerPhis) {
+      auto [lower, size] = bounds[PN];
+      for (auto [V, BB] : zip(PN->incoming_values(), PN->blocks())) {
+        FatPointer in = {Constant::getNullValue(lower->getType()),
+                         ConstantInt::getAllOnesValue(Type::getInt64Ty(Ctx))};
+        if (auto It = bounds.find(V); It != bounds.end())
+          in = It->second;
+        cast<PHINode>(lower)->addIncoming(in.lower, BB);
+        cast<PHINode>(size)->addIncoming(in.size, BB);
+      }
+      worklist.append({cast<PHINode>(lower), cast<PHINode>(size)});
+    }
+    SmallPtrSet<PHINode *, 16> boundsPhis(worklist.begin(), worklist.end());
+
+    DenseMap<Value *, Value *> replaced;
+    int kept = worklist.size();
+    while (!worklist.empty()) {
+      auto *Phi = worklist.pop_back_val();
+      if (replaced.contains(Phi))
+        continue;
+      Value *same = nullptr;
+      bool trivial = true;
+      for (Value *V : Phi->incoming_values()) {
+        if (V == Phi || V == same)
+          continue;
+        if (same) {
+          trivial = false;
+          break;
+        }
+        same = V;
+      }
+      if (!trivial || !same)
+        continue;
+      // phis using this one may become trivial in turn
+      for (auto *U : Phi->users())
+        if (auto *UserPhi = dyn_cast<PHINode>(U);
+            UserPhi && UserPhi != Phi && boundsPhis.contains(UserPhi))
+          worklist.push_back(UserPhi);
+      Phi->replaceAllUsesWith(same);
+      replaced[Phi] = same;
+      --kept;
+    }
+
+    auto resolve = [&](Value *V) {
+      while (auto *R = replaced.lookup(V))
+        V = R;
+      return V;
+    };
+    for (auto &[V, fp] : bounds)
+      fp = {resolve(fp.lower), resolve(fp.size)};
+    for (auto [Phi, _] : replaced)
+      cast<PHINode>(Phi)->eraseFromParent();
+    return kept;
+  }
+
+  static unsigned numTrapSites(Module &M) {
+    auto *table = M.getNamedGlobal(SiteTableName);
+    return table ? table->getValueType()->getArrayNumElements() : 0;
+  }
+
+  // Appends an entry for each of F's check sites to the site table. The
+  // table is a constant, so it is replaced by a longer copy.
+  static void addTrapSites(Function &F, ArrayRef<DebugLoc> sites) {
+    auto &M = *F.getParent();
+    auto &Ctx = M.getContext();
+    auto *Int32Ty = Type::getInt32Ty(Ctx);
+    auto *SiteTy = getSiteType(Ctx);
+    auto *table = M.getNamedGlobal(SiteTableName);
+    auto makeString = [&](StringRef Str) -> Constant * {
+      auto *Init = ConstantDataArray::getString(Ctx, Str);
+      auto *GV = new GlobalVariable(M, Init->getType(), true,
+                                    GlobalValue::PrivateLinkage, Init,
+                                    ".vaporeon.str");
+      GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+      return GV;
+    };
+
+    SmallVector<Constant *, 16> entries;
+    for (unsigned i = 0; i < numTrapSites(M); ++i)
+      entries.push_back(table->getInitializer()->getAggregateElement(i));
+    auto *function = makeString(F.getName());
+    StringMap<Constant *> files;
+    for (auto &Loc : sites) {
+      Constant *file = ConstantPointerNull::get(PointerType::getUnqual(Ctx));
+      unsigned line = 0, column = 0;
+      if (Loc) {
+        auto &name = files[Loc->getFilename()];
+        if (!name)
+          name = makeString(Loc->getFilename());
+        file = name;
+        line = Loc.getLine();
+        column = Loc.getCol();
+      }
+      entries.push_back(ConstantStruct::get(
+          SiteTy, {function, file, ConstantInt::get(Int32Ty, line),
+                   ConstantInt::get(Int32Ty, column)}));
+    }
+
+    auto *TableTy = ArrayType::get(SiteTy, entries.size());
+    auto *grown = new GlobalVariable(M, TableTy, true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, entries));
+    grown->takeName(table);
+    table->replaceAllUsesWith(grown);
+    table->eraseFromParent();
+  }
+
+  // Returns the first and last address C.SI writes in iterations
+  // [0, LastIteration] of L, or {nullptr, nullptr} if its address is not an
+  // affine recurrence of L or the range cannot be expanded at InsertPt.
+  static std::pair<const SCEV *, const SCEV *>
+  affineAccessRange(const BoundsCheck &C, Loop *L, const SCEV *LastIteration,
+                    ScalarEvolution &SE, DominatorTree &DT,
+                    SCEVExpander &Expander, Instruction *InsertPt) {
+    auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(C.ptr));
+    if (!AR || AR->getLoop() != L || !AR->isAffine() || !AR->hasNoSelfWrap())
+      return {nullptr, nullptr};
+    for (Value *V : {C.bounds.lower, C.bounds.size})
+      if (auto *I = dyn_cast<Instruction>(V))
+        if (!DT.dominates(I, InsertPt))
+          return {nullptr, nullptr};
+
+    LastIteration = SE.getTruncateOrZeroExtend(
+        LastIteration, AR->getStepRecurrence(SE)->getType());
+    const SCEV *First = AR->getStart();
+    const SCEV *Last = AR->evaluateAtIteration(LastIteration, SE);
+    if (!Expander.isSafeToExpandAt(First, InsertPt) ||
+        !Expander.isSafeToExpandAt(Last, InsertPt))
+      return {nullptr, nullptr};
+    return {First, Last};
+  }
+
+  // Expands the first and last address of an affine access at InsertPt and
+  // returns whether either one is out of bounds.
+  static Value *emitRangeOutOfBounds(const BoundsCheck &C, const SCEV *First,
+                                     const SCEV *Last, SCEVExpander &Expander,
+                                     Instruction *InsertPt) {
+    auto *FirstPtr = Expander.expandCodeFor(First, C.ptr->getType(), InsertPt);
+    auto *LastPtr = Expander.expandCodeFor(Last, C.ptr->getType(), InsertPt);
+    auto *firstOutOfBounds = emitOutOfBounds(FirstPtr, C.bounds, InsertPt);
+    auto *lastOutOfBounds = emitOutOfBounds(LastPtr, C.bounds, InsertPt);
+    return BinaryOperator::CreateOr(firstOutOfBounds, lastOutOfBounds, "",
+                                    InsertPt);
+  }
+
+  // True if every exit of L is decided before BB runs in an iteration, so BB
+  // does not run in the final one.
+  static bool runsAfterEveryExit(BasicBlock *BB, Loop *L, DominatorTree &DT) {
+    SmallVector<BasicBlock *, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    return all_of(Exiting, [&](BasicBlock *E) {
+      return E != BB && DT.dominates(E, BB);
+    });
+  }
+
+  // Builds a preheader condition that is true iff some execution of C.SI in L
+  // would write out of bounds, or returns nullptr if the range of addresses
+  // written by C.SI is not computable. The address must be an affine
+  // recurrence of L, and C.SI must run on every iteration that reaches the
+  // latch, so the first and last address written bound all others.
+  static Value *hoistLoopCheck(const BoundsCheck &C, Loop *L,
+                               ScalarEvolution &SE, DominatorTree &DT,
+                               SCEVExpander &Expander) {
+    auto *Preheader = L->getLoopPreheader();
+    auto *Latch = L->getLoopLatch();
+    if (!Preheader || !Latch)
+      return nullptr;
+    auto *InsertPt = Preheader->getTerminator();
+
+    const SCEV *BTC = SE.getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(BTC))
+      return nullptr;
+
+    // If the store happens before every exit it also runs on the final
+    // iteration; if every exit happens before the store it runs on all but
+    // the final one (and not at all when the backedge is never taken).
+    auto *BB = C.SI->getParent();
+    if (!DT.dominates(BB, Latch))
+      return nullptr;
+    SmallVector<BasicBlock *, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    bool beforeExits = all_of(
+        Exiting, [&](BasicBlock *E) { return DT.dominates(BB, E); });
+    bool afterExits = runsAfterEveryExit(BB, L, DT);
+    if (!beforeExits && !afterExits)
+      return nullptr;
+
+    const SCEV *LastIteration =
+        beforeExits ? BTC : SE.getMinusSCEV(BTC, SE.getOne(BTC->getType()));
+    auto [First, Last] = affineAccessRange(C, L, LastIteration, SE, DT,
+                                           Expander, InsertPt);
+    if (!First)
+      return nullptr;
+
+    Value *cond = emitRangeOutOfBounds(C, First, Last, Expander, InsertPt);
+    if (afterExits) {
+      auto *BTCValue = Expander.expandCodeFor(BTC, BTC->getType(), InsertPt);
+      auto *taken = new ICmpInst(InsertPt, ICmpInst::ICMP_NE, BTCValue,
+                                 Constant::getNullValue(BTC->getType()));
+      cond = BinaryOperator::CreateAnd(cond, taken, "", InsertPt);
+    }
+    return cond;
+  }
+
+  // Computes in the preheader a limit pointer such that the check on C.SI,
+  // a store through a pointer induction variable with a constant positive
+  // stride, is `ptr >=u limit`. The pointer never decreases, so once it
+  // starts at or above lower only the end of the buffer can be crossed. If it
+  // starts below lower the limit is null and the first store traps, which is
+  // where the original check traps: the store runs on every iteration that
+  // reaches the latch, so its first execution writes the start address. A
+  // self-wrapping pointer would have to step over the whole gap between the
+  // buffer and the top of the address space, so <nw> is treated like <nuw>.
+  static Value *strengthReduceCheck(const BoundsCheck &C, Loop *L,
+                                    ScalarEvolution &SE, DominatorTree &DT,
+                                    SCEVExpander &Expander) {
+    auto *Preheader = L->getLoopPreheader();
+    auto *Latch = L->getLoopLatch();
+    if (!Preheader || !Latch || !DT.dominates(C.SI->getParent(), Latch))
+      return nullptr;
+    auto *InsertPt = Preheader->getTerminator();
+
+    auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(C.ptr));
+    if (!AR || AR->getLoop() != L || !AR->isAffine() ||
+        !AR->hasNoSelfWrap())
+      return nullptr;
+    auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+    if (!Step || !Step->getAPInt().isStrictlyPositive())
+      return nullptr;
+    for (Value *V : {C.bounds.lower, C.bounds.size})
+      if (auto *I = dyn_cast<Instruction>(V))
+        if (!DT.dominates(I, InsertPt))
+          return nullptr;
+    if (!Expander.isSafeToExpandAt(AR->getStart(), InsertPt))
+      return nullptr;
+
+    auto &Ctx = InsertPt->getContext();
+    auto *start =
+        Expander.expandCodeFor(AR->getStart(), C.ptr->getType(), InsertPt);
+    auto *end = GetElementPtrInst::Create(Type::getInt8Ty(Ctx), C.bounds.lower,
+                                          {C.bounds.size}, "end", InsertPt);
+    auto *below = new ICmpInst(InsertPt, ICmpInst::ICMP_ULT, start,
+                               C.bounds.lower);
+    return SelectInst::Create(
+        below, ConstantPointerNull::get(cast<PointerType>(C.ptr->getType())),
+        end, "limit", InsertPt);
+  }
+
+  // True if every path from From's terminator reaches To without passing an
+  // instruction that may not fall through, so a check moved from To up to
+  // From only traps where the original would have.
+  static bool fallsThroughTo(BasicBlock *From, BasicBlock *To) {
+    SmallPtrSet<BasicBlock *, 16> seen;
+    SmallVector<BasicBlock *, 16> worklist(successors(From));
+    while (!worklist.empty()) {
+      auto *BB = worklist.pop_back_val();
+      if (BB == To || !seen.insert(BB).second)
+        continue;
+      if (!isGuaranteedToTransferExecutionToSuccessor(BB))
+        return false;
+      append_range(worklist, successors(BB));
+    }
+    return true;
+  }
+
+  // Finds the coldest block that dominates the check's current placement,
+  // is post-dominated by it and falls through to it, and where ptr and its
+  // bounds are already available. The check is anticipated there, so it can
+  // be evaluated once in that block instead of on every execution of the
+  // store. Returns the block's terminator, or nullptr if no block is colder
+  // than the placement's own.
+  static Instruction *findColderPlacement(const BoundsCheck &C,
+                                          DominatorTree &DT,
+                                          PostDominatorTree &PDT,
+                                          BlockFrequencyInfo &BFI) {
+    Instruction *From = C.insertPt ? C.insertPt : C.SI;
+    auto *BB = From->getParent();
+    for (auto &I : *BB) {
+      if (&I == From)
+        break;
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+        return nullptr;
+    }
+
+    Instruction *best = nullptr;
+    uint64_t bestFreq = BFI.getBlockFreq(BB).getFrequency();
+    for (auto *N = DT.getNode(BB)->getIDom(); N; N = N->getIDom()) {
+      auto *D = N->getBlock();
+      auto *T = D->getTerminator();
+      bool available = all_of(
+          ArrayRef<Value *>{C.ptr, C.bounds.lower, C.bounds.size, C.limit},
+          [&](Value *V) {
+            auto *I = dyn_cast_or_null<Instruction>(V);
+            return !I || DT.dominates(I, T);
+          });
+      if (!available || !PDT.dominates(BB, D) || !fallsThroughTo(D, BB))
+        break;
+      uint64_t freq = BFI.getBlockFreq(D).getFrequency();
+      if (freq < bestFreq) {
+        best = T;
+        bestFreq = freq;
+      }
+    }
+    return best;
+  }
+
+  // Clones L into an unchecked copy that runs when a single test in the
+  // preheader shows every address its checked stores can write is in bounds;
+  // otherwise the original, checked loop runs. The test never traps, so it
+  // may cover iterations a store skips and the symbolic maximum trip count
+  // suffices. Fails if some check is not affine in L, or if a check outside
+  // L uses a value defined in L, since LCSSA would have to rewrite it.
+  static bool versionLoop(Loop *L, ArrayRef<BoundsCheck> loopChecks,
+                          ArrayRef<BoundsCheck> otherChecks, LoopInfo &LI,
+                          ScalarEvolution &SE, DominatorTree &DT,
+                          SCEVExpander &Expander,
+                          std::vector<Guard> &guards,
+                          int &instructionsAdded) {
+    auto *Preheader = L->getLoopPreheader();
+    if (!L->isInnermost() || !L->isLoopSimplifyForm() || !L->isSafeToClone())
+      return false;
+    auto *InsertPt = Preheader->getTerminator();
+    const SCEV *MaxBTC = SE.getSymbolicMaxBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(MaxBTC))
+      return false;
+
+    for (auto &C : otherChecks)
+      for (Value *V : {C.ptr, C.bounds.lower, C.bounds.size})
+        if (auto *I = dyn_cast<Instruction>(V))
+          if (L->contains(I))
+            return false;
+    // the unchecked copy would run a guarded call without its guard
+    for (auto &G : guards)
+      if (L->contains(G.insertPt))
+        return false;
+
+    SmallVector<std::pair<const SCEV *, const SCEV *>, 4> ranges;
+    for (auto &C : loopChecks) {
+      const SCEV *LastIteration = MaxBTC;
+      if (runsAfterEveryExit(C.SI->getParent(), L, DT))
+        LastIteration = SE.getMinusSCEV(MaxBTC, SE.getOne(MaxBTC->getType()));
+      auto range =
+          affineAccessRange(C, L, LastIteration, SE, DT, Expander, InsertPt);
+      if (!range.first)
+        return false;
+      ranges.push_back(range);
+    }
+
+    formLCSSA(*L, DT, &LI, &SE);
+    Value *cond = nullptr;
+    for (auto [C, range] : zip(loopChecks, ranges)) {
+      auto *outOfBounds = emitRangeOutOfBounds(C, range.first, range.second,
+                                               Expander, InsertPt);
+      cond = cond ? BinaryOperator::CreateOr(cond, outOfBounds, "", InsertPt)
+                  : outOfBounds;
+      instructionsAdded += 12;
+    }
+
+    // Preheader -> (checked preheader | unchecked preheader) -> loop
+    auto *CheckedPreheader =
+        SplitBlock(Preheader, InsertPt, &DT, &LI, nullptr,
+                   Preheader->getName() + ".checked");
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> NewBlocks;
+    auto *Unchecked = cloneLoopWithPreheader(CheckedPreheader, Preheader, L,
+                                             VMap, ".unchecked", &LI, &DT,
+                                             NewBlocks);
+    remapInstructionsInBlocks(NewBlocks, VMap);
+    auto *br = BranchInst::Create(CheckedPreheader,
+                                  Unchecked->getLoopPreheader(), cond);
+    ReplaceInstWithInst(Preheader->getTerminator(), br);
+    // checks hoisted into the old preheader still run on both paths
+    for (auto &G : guards)
+      if (G.insertPt == InsertPt)
+        G.insertPt = br;
+
+    // the exits now also receive the unchecked loop's LCSSA values
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+    L->getUniqueExitBlocks(ExitBlocks);
+    for (auto *Exit : ExitBlocks) {
+      for (auto &PN : Exit->phis()) {
+        SmallVector<std::pair<Value *, BasicBlock *>, 4> incoming;
+        for (unsigned i = 0; i < PN.getNumIncomingValues(); ++i)
+          if (L->contains(PN.getIncomingBlock(i)))
+            incoming.push_back(
+                {PN.getIncomingValue(i), PN.getIncomingBlock(i)});
+        for (auto [V, BB] : incoming) {
+          Value *mapped = VMap.lookup(V);
+          PN.addIncoming(mapped ? mapped : V, cast<BasicBlock>(VMap[BB]));
+        }
+      }
+    }
+    DT.recalculate(*Preheader->getParent());
+    SE.forgetLoop(L);
+    for (auto *BB : NewBlocks)
+      instructionsAdded += BB->size();
+    return true;
+  }
+
+  // Rewrites S, a SCEV over the arguments of CB's callee, in terms of CB's
+  // actual arguments, or returns nullptr if it has parts only meaningful in
+  // the callee (such as recurrences of its loops).
+  static const SCEV *translateToCallSite(const SCEV *S, CallBase &CB,
+                                         ScalarEvolution &SE) {
+    if (auto *C = dyn_cast<SCEVConstant>(S))
+      return SE.getConstant(C->getAPInt());
+    if (auto *U = dyn_cast<SCEVUnknown>(S)) {
+      auto *A = dyn_cast<Argument>(U->getValue());
+      return A ? SE.getSCEV(CB.getArgOperand(A->getArgNo())) : nullptr;
+    }
+    if (auto *Cast = dyn_cast<SCEVCastExpr>(S)) {
+      auto *Op = translateToCallSite(Cast->getOperand(0), CB, SE);
+      if (!Op)
+        return nullptr;
+      switch (S->getSCEVType()) {
+      case scPtrToInt:
+        return SE.getPtrToIntExpr(Op, S->getType());
+      case scTruncate:
+        return SE.getTruncateExpr(Op, S->getType());
+      case scZeroExtend:
+        return SE.getZeroExtendExpr(Op, S->getType());
+      case scSignExtend:
+        return SE.getSignExtendExpr(Op, S->getType());
+      default:
+        return nullptr;
+      }
+    }
+    if (auto *Div = dyn_cast<SCEVUDivExpr>(S)) {
+      auto *LHS = translateToCallSite(Div->getLHS(), CB, SE);
+      auto *RHS = translateToCallSite(Div->getRHS(), CB, SE);
+      return LHS && RHS ? SE.getUDivExpr(LHS, RHS) : nullptr;
+    }
+    if (isa<SCEVAddRecExpr>(S) || !isa<SCEVNAryExpr>(S))
+      return nullptr;
+    SmallVector<const SCEV *, 4> Ops;
+    for (auto *Op : cast<SCEVNAryExpr>(S)->operands()) {
+      Ops.push_back(translateToCallSite(Op, CB, SE));
+      if (!Ops.back())
+        return nullptr;
+    }
+    switch (S->getSCEVType()) {
+    case scAddExpr:
+      return SE.getAddExpr(Ops);
+    case scMulExpr:
+      return SE.getMulExpr(Ops);
+    case scSMaxExpr:
+    case scUMaxExpr:
+    case scSMinExpr:
+    case scUMinExpr:
+      return SE.getMinMaxExpr(S->getSCEVType(), Ops);
+    case scSequentialUMinExpr:
+      return SE.getSequentialMinMaxExpr(S->getSCEVType(), Ops);
+    default:
+      return nullptr;
+    }
+  }
+
+  // Returns the lowest value of Begin and the highest value of End over every
+  // execution of an access in BB, as SCEVs over the function's arguments, or
+  // {nullptr, nullptr} if they cannot be bounded. Each enclosing loop must
+  // run the access (or the loop nested in it) on every iteration up to a
+  // computable exit count with a constant step, so the first and last
+  // iterations bound all others, and the outermost one must run on every
+  // call, so checking the whole range in the caller only traps calls that
+  // would have written out of bounds.
+  static std::pair<const SCEV *, const SCEV *>
+  accessBounds(const SCEV *Begin, const SCEV *End, BasicBlock *BB,
+               LoopInfo &LI, DominatorTree &DT, PostDominatorTree &PDT,
+               ScalarEvolution &SE) {
+    // an access after every exit misses the final iteration; subtracting a
+    // step rather than evaluating at BTC - 1 keeps a zero trip count from
+    // wrapping
+    auto extreme = [&](const SCEV *S, Loop *L, const SCEV *BTC,
+                       bool skipsLast, bool highest) -> const SCEV * {
+      if (SE.isLoopInvariant(S, L))
+        return S;
+      auto *AR = dyn_cast<SCEVAddRecExpr>(S);
+      if (!AR || AR->getLoop() != L || !AR->isAffine() ||
+          !AR->hasNoSelfWrap())
+        return nullptr;
+      auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+      if (!Step)
+        return nullptr;
+      if (Step->getAPInt().isNegative() == highest)
+        return AR->getStart();
+      const SCEV *Last = AR->evaluateAtIteration(
+          SE.getTruncateOrZeroExtend(BTC, Step->getType()), SE);
+      return skipsLast ? SE.getMinusSCEV(Last, Step) : Last;
+    };
+
+    const SCEV *Min = Begin, *Max = End;
+    BasicBlock *Runs = BB;
+    for (auto *L = LI.getLoopFor(BB); L; L = L->getParentLoop()) {
+      auto *Latch = L->getLoopLatch();
+      const SCEV *BTC = SE.getBackedgeTakenCount(L);
+      if (!Latch || !L->getLoopPreheader() || isa<SCEVCouldNotCompute>(BTC) ||
+          !DT.dominates(Runs, Latch))
+        return {nullptr, nullptr};
+      SmallVector<BasicBlock *, 4> Exiting;
+      L->getExitingBlocks(Exiting);
+      bool beforeExits = all_of(
+          Exiting, [&](BasicBlock *E) { return DT.dominates(Runs, E); });
+      if (!beforeExits && !runsAfterEveryExit(Runs, L, DT))
+        return {nullptr, nullptr};
+      Min = extreme(Min, L, BTC, !beforeExits, false);
+      Max = extreme(Max, L, BTC, !beforeExits, true);
+      if (!Min || !Max)
+        return {nullptr, nullptr};
+      Runs = L->getLoopPreheader();
+    }
+    if (!PDT.dominates(Runs, &BB->getParent()->getEntryBlock()))
+      return {nullptr, nullptr};
+    return {Min, Max};
+  }
+
+  // Summarizes the writes F makes through each pointer argument, using the
+  // summaries of its callees, which the bottom-up walk has already built.
+  // Calls to summarized callees are recorded with their extents expanded at
+  // the call, and F is cloned into a copy that leaves the writes its own
+  // summaries cover to its callers.
+  static void summarizeFunction(Function &F, FunctionAnalysisManager &FAM,
+                                ModuleSummaries &Summaries) {
+    auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    auto *Int64Ty = Type::getInt64Ty(F.getContext());
+    SCEVExpander Expander(SE, DL, "vaporeon");
+
+    // (access, pointer, bytes written from the pointer)
+    SmallVector<std::tuple<Instruction *, Value *, const SCEV *>, 16> writes;
+    SmallVector<CallBase *, 4> calls;
+    for (auto &I : instructions(F)) {
+      if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        auto size = DL.getTypeStoreSize(SI->getValueOperand()->getType());
+        writes.push_back({SI, SI->getPointerOperand(),
+                          SE.getConstant(Int64Ty, size.getFixedValue())});
+        continue;
+      }
+      auto *CB = dyn_cast<CallBase>(&I);
+      auto *Callee = CB ? CB->getCalledFunction() : nullptr;
+      if (!Callee || !Summaries.summaries.contains(Callee) ||
+          CB->getFunctionType() != Callee->getFunctionType())
+        continue;
+      SmallVector<std::pair<Value *, const SCEV *>, 2> args;
+      for (auto &S : Summaries.summaries[Callee]) {
+        // the extent is built from CB's own arguments, which dominate it,
+        // so only the expression itself can make it unsafe to expand there
+        auto *Extent = translateToCallSite(S.Extent, *CB, SE);
+        if (!Extent || !Expander.isSafeToExpand(Extent)) {
+          args.clear();
+          break;
+        }
+        args.push_back({CB->getArgOperand(S.ArgNo), Extent});
+      }
+      if (args.empty())
+        continue;
+      SummarizedCall Call{Summaries.clones.lookup(Callee), {}};
+      for (auto [ptr, Extent] : args) {
+        Call.args.push_back(
+            {ptr, Expander.expandCodeFor(Extent, Int64Ty, CB)});
+        writes.push_back({CB, ptr, Extent});
+      }
+      Summaries.calls[CB] = Call;
+      calls.push_back(CB);
+    }
+
+    SmallVector<AccessSummary, 2> summaries;
+    for (auto &A : F.args()) {
+      if (!A.getType()->isPointerTy())
+        continue;
+      const SCEV *Extent = nullptr;
+      for (auto [I, ptr, bytes] : writes) {
+        if (getUnderlyingObject(ptr) != &A)
+          continue;
+        const SCEV *Begin = SE.getMinusSCEV(SE.getSCEV(ptr), SE.getSCEV(&A));
+        const SCEV *Min = nullptr, *Max = nullptr;
+        if (!isa<SCEVCouldNotCompute>(Begin)) {
+          Begin = SE.getTruncateOrSignExtend(Begin, Int64Ty);
+          std::tie(Min, Max) =
+              accessBounds(Begin, SE.getAddExpr(Begin, bytes),
+                           I->getParent(), LI, DT, PDT, SE);
+        }
+        if (!Min || !SE.isKnownNonNegative(Min)) {
+          Extent = nullptr;
+          break;
+        }
+        Extent = Extent ? SE.getUMaxExpr(Extent, Max) : Max;
+      }
+      bool callerComputable =
+          Extent && !SCEVExprContains(Extent, [](const SCEV *S) {
+            auto *U = dyn_cast<SCEVUnknown>(S);
+            return isa<SCEVAddRecExpr>(S) ||
+                   (U && !isa<Argument>(U->getValue()));
+          });
+      if (callerComputable)
+        summaries.push_back({A.getArgNo(), Extent});
+    }
+    if (summaries.empty())
+      return;
+
+    ValueToValueMapTy VMap;
+    auto *Clone = CloneFunction(&F, VMap);
+    Clone->setName(F.getName() + ".summarized");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    for (auto *CB : calls) {
+      SummarizedCall Call = Summaries.calls.lookup(CB);
+      for (auto &[ptr, extent] : Call.args) {
+        if (Value *mapped = VMap.lookup(ptr))
+          ptr = mapped;
+        extent = VMap.lookup(extent);
+      }
+      Summaries.calls[cast<CallBase>(VMap[CB])] = Call;
+    }
+    for (auto &S : summaries)
+      Summaries.exemptArgs[Clone].push_back(S.ArgNo);
+    Summaries.summaries[&F] = std::move(summaries);
+    Summaries.clones[&F] = Clone;
+    if (PRINTDEBUG)
+      dbgs() << "Summarized " << F.getName() << " into " << Clone->getName()
+             << "\n";
+  }
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    ModuleSummaries Summaries;
+    if (Options.Interprocedural) {
+      // scc_iterator visits callees before their callers
+      auto &CG = MAM.getResult<CallGraphAnalysis>(M);
+      for (auto SCC = scc_begin(&CG); !SCC.isAtEnd(); ++SCC)
+        for (auto *N : *SCC)
+          if (auto *F = N->getFunction(); F && !F->isDeclaration())
+            summarizeFunction(*F, FAM, Summaries);
+      for (auto &F : M)
+        FAM.invalidate(F, PreservedAnalyses::none());
+      if (PRINTDEBUG)
+        dbgs() << Summaries.clones.size() << " functions summarized\n";
+    }
+
+    for (auto &F : M) {
+      if (F.isDeclaration())
+        continue;
+      instrument(F, FAM, Summaries);
+      FAM.invalidate(F, PreservedAnalyses::none());
+    }
+
+    // callers that could not check a call keep calling the original, so drop
+    // clones nothing calls, callers first
+    for (auto &[F, Clone] : reverse(Summaries.clones))
+      if (Clone->use_empty())
+        Clone->eraseFromParent();
+    return PreservedAnalyses::none();
+  }
 
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    instrument(F, FAM, ModuleSummaries());
+    return PreservedAnalyses::none();
+  }
+
+  void instrument(Function &F, FunctionAnalysisManager &FAM,
+                  const ModuleSummaries &Summaries) {
+    // functions this pass defines
+    StringRef ownFunctions[] = {DeoptimizeTrapName, TrapHandlerName,
+                                CheckThunkName, LimitCheckThunkName,
+                                SetChecksEnabledName, SamplerName,
+                                SampleReporterName, GuardedAllocName,
+                                GuardedFreeName, GuardedExitName, AuditName,
+                                CoverageInitName, ShadowMapName,
+                                ShadowEntryName};
+    if (is_contained(ownFunctions, F.getName()) ||
+        F.hasFnAttribute(UncheckedAttr))
+      return;
     std::vector<StoreInst *> stores;
-    struct FatPointer {
-      Value *lower, *size;
-    };
     DenseMap<Value *, FatPointer> bounds;
     DenseMap<Value *, FatPointer> localVariableBounds;
+    // the loc_lower and loc_size slots, in creation order
+    SmallVector<AllocaInst *, 8> boundsSlots;
+    // loads materializing bounds: of incoming fat pointers at entry, and of
+    // the slots of pointer locals
+    SmallVector<LoadInst *, 8> paramBounds;
+    SmallVector<WeakVH, 8> slotReloads;
     std::deque<Instruction *> bfs;
+    // raw pointers loaded from incoming fat pointers, and the ones whose
+    // writes callers check against this function's summary
+    DenseMap<Value *, Value *> unpacked;
+    DenseSet<Value *> exemptRoots;
+    auto exemptArgs = Summaries.exemptArgs.lookup(&F);
+    // buffers whose overflows hit a guard page instead of being checked
+    SmallVector<CallInst *, 2> guardedRoots;
 
     Type *index_type = llvm::Type::getInt32Ty(F.getContext());
     Type *size_type = llvm::Type::getInt64Ty(F.getContext());
@@ -45,6 +3001,26 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
 
     int instructionsAdded = 0;
 
+    // pointers loaded from and stored to memory, whose bounds go through the
+    // shadow table unless the memory is a pointer local, and the lookups
+    SmallVector<LoadInst *, 8> shadowedLoads;
+    SmallVector<StoreInst *, 8> shadowedStores;
+    std::vector<SmallVector<WeakVH, 16>> shadowLookups;
+    if (Options.ShadowBounds) {
+      auto *Ptr = PointerType::getUnqual(F.getContext());
+      for (auto &I : instructions(F)) {
+        if (auto *LI = dyn_cast<LoadInst>(&I);
+            LI && LI->isSimple() && LI->getType() == Ptr &&
+            LI->getPointerOperandType() == Ptr)
+          shadowedLoads.push_back(LI);
+        else if (auto *SI = dyn_cast<StoreInst>(&I);
+                 SI && SI->isSimple() &&
+                 SI->getValueOperand()->getType() == Ptr &&
+                 SI->getPointerOperandType() == Ptr)
+          shadowedStores.push_back(SI);
+      }
+    }
+
     {
       if (PRINTDEBUG)
         dbgs() << "Starting VAPOREON pass\n";
@@ -55,8 +3031,23 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
       auto insertionPoint = &*F.getEntryBlock().getFirstNonPHIOrDbgOrAlloca();
       if (PRINTDEBUG)
         dbgs() << "[Step 0] fix up parameters\n";
+      bool plainPointers = keepsPlainPointers(F);
+      if (Options.Fuzz && F.getName() == FuzzTargetName &&
+          F.arg_size() == 2 && F.getArg(0)->getType()->isPointerTy() &&
+          F.getArg(1)->getType() == size_type) {
+        Argument *data = F.getArg(0);
+        auto *raw_pointer = GetElementPtrInst::Create(
+            Type::getInt8Ty(F.getContext()), data,
+            {Constant::getIntegerValue(index_type, APInt(32, 0))}, "fuzz_data",
+            insertionPoint);
+        data->replaceUsesWithIf(
+            raw_pointer, [&](Use &U) { return U.getUser() != raw_pointer; });
+        instructionsAdded += 1;
+        bounds[raw_pointer] = {data, F.getArg(1)};
+        bfs.emplace_back(raw_pointer);
+      }
       for (auto &param : F.args()) {
-        if (param.getType()->isPointerTy()) {
+        if (!plainPointers && param.getType()->isPointerTy()) {
           Type *ptr_type = param.getType();
           if (PRINTDEBUG)
             dbgs() << "ptr_type = " << *ptr_type << "\n";
@@ -92,6 +3083,7 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
           auto raw_pointer = new LoadInst(ptr_type, addr3, "", insertionPoint);
 
           instructionsAdded += 6;
+          paramBounds.append({lower, size});
 
           for (auto u : users) {
             u->replaceUsesOfWith(&param, raw_pointer);
@@ -101,12 +3093,25 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
             dbgs() << "raw = " << *raw_pointer << "\n";
           bounds[raw_pointer] = {lower, size};
           bfs.emplace_back(raw_pointer);
+          unpacked[&param] = raw_pointer;
+          if (is_contained(exemptArgs, param.getArgNo()))
+            exemptRoots.insert(raw_pointer);
         }
       }
 
       if (PRINTDEBUG)
         dbgs() << "[Step 1] find all allocas\n";
       // Step 1: find all allocas
+      // a free cannot go between a musttail call and its return, and the
+      // runtime passes Linux's mmap flags
+      bool canGuard =
+          Options.GuardPageThreshold &&
+          Triple(F.getParent()->getTargetTriple()).isOSLinux() &&
+          none_of(instructions(F), [](Instruction &I) {
+            auto *CI = dyn_cast<CallInst>(&I);
+            return CI && CI->isMustTailCall();
+          });
+      std::vector<AllocaInst *> to_guard;
       for (auto &BB : F) {
         for (auto &I : BB) {
           if (auto *AI = dyn_cast<AllocaInst>(&I)) {
@@ -115,16 +3120,25 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
             auto alloc_type = AI->getAllocatedType();
             alloca_insertion_point = AI->getNextNonDebugInstruction();
             if (alloc_type->isArrayTy()) {
-              size_t alloc_size = alloc_type->getArrayNumElements();
+              // checks compare byte offsets, so the size is in bytes too
+              size_t alloc_size =
+                  F.getParent()->getDataLayout().getTypeAllocSize(alloc_type);
               if (PRINTDEBUG)
                 dbgs() << "instruction allocates " << alloc_size
-                       << " element(s)\n";
+                       << " byte(s)\n";
               auto InsertionPoint = AI->getNextNonDebugInstruction();
               if (PRINTDEBUG)
                 if (!InsertionPoint) {
                   dbgs() << "No insertion point found...\n";
                 }
 
+              if (canGuard && AI->isStaticAlloca() &&
+                  F.getParent()->getDataLayout().getTypeAllocSize(
+                      alloc_type) >= Options.GuardPageThreshold) {
+                to_guard.push_back(AI);
+                continue;
+              }
+
               // Store allocated value into lower
               auto idx = Constant::getIntegerValue(
                   Type::getInt64Ty(F.getContext()), APInt(64, alloc_size));
@@ -136,6 +3150,20 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
           }
         }
       }
+      for (auto *AI : to_guard) {
+        auto idx = ConstantInt::get(
+            Type::getInt64Ty(F.getContext()),
+            F.getParent()->getDataLayout().getTypeAllocSize(
+                AI->getAllocatedType()));
+        auto *buffer = moveToGuardedBuffer(AI);
+        bounds[buffer] = {buffer, idx};
+        bfs.emplace_back(buffer);
+        guardedRoots.push_back(buffer);
+        instructionsAdded += 2;
+      }
+      if (PRINTDEBUG && Options.GuardPageThreshold)
+        dbgs() << to_guard.size()
+               << " stack arrays moved to guard-page buffers\n";
 
       if (PRINTDEBUG)
         dbgs() << "[Step 1] add bounds\n";
@@ -147,13 +3175,30 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
                                         alloc_type->getPointerAddressSpace(),
                                         "loc_size", AI);
         localVariableBounds[AI] = {lowerAlloc, sizeAlloc};
+        boundsSlots.append({lowerAlloc, sizeAlloc});
         if (PRINTDEBUG)
           dbgs() << "Added local variable bounds for " << *AI << "\n";
       }
+
+      // pointers loaded from memory are roots with their shadowed bounds
+      erase_if(shadowedLoads, [&](LoadInst *LI) {
+        return localVariableBounds.contains(LI->getPointerOperand());
+      });
+      erase_if(shadowedStores, [&](StoreInst *SI) {
+        return localVariableBounds.contains(SI->getPointerOperand());
+      });
+      for (auto *LI : shadowedLoads) {
+        bounds[LI] = emitShadowLoad(LI, shadowLookups);
+        bfs.emplace_back(LI);
+        instructionsAdded += shadowLookups.back().size();
+      }
     }
 
     DenseSet<Instruction *> visited;
     DenseSet<StoreInst *> ourStores;
+    SmallVector<PHINode *, 8> pointerPhis;
+    // stores packing fat pointers for calls
+    SmallVector<StoreInst *, 8> packStores;
 
     // Step 2: generate code to propagate bounds at runtime
     while (!bfs.empty()) {
@@ -167,31 +3212,20 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
 
       auto [lower, size] = bounds[front];
 
-      for (auto Use : front->users()) {
+      // packing a call argument removes the call from front's users
+      for (auto Use : SmallVector<User *, 8>(front->users())) {
         if (PRINTDEBUG)
           dbgs() << "found use " << *Use << "\n";
         if (auto Inst = dyn_cast<Instruction>(Use)) {
           // some instruction is using this value, propagate bounds
-          if (Inst->getOpcode() == Instruction::PHI) {
-            if (bounds.contains(Inst)) {
-              // we already found it in a prior pass, now we need to update
-              // second argument
-              PHINode *lowerPhi = dyn_cast<PHINode>(bounds[Inst].lower);
-              PHINode *sizePhi = dyn_cast<PHINode>(bounds[Inst].size);
-              lowerPhi->setOperand(1, lower);
-              sizePhi->setOperand(1, size);
-            } else {
-              // first time finding this phi, initialize it
-              auto InsertionPoint = front->getNextNonDebugInstruction();
-              PHINode *lowerPhi = PHINode::Create(
-                  bounds[front].lower->getType(), 2, "lower", InsertionPoint);
-              PHINode *sizePhi = PHINode::Create(bounds[front].lower->getType(),
-                                                 2, "size", InsertionPoint);
+          if (auto *PN = dyn_cast<PHINode>(Inst)) {
+            // mirror the phi once; its incoming bounds are filled in after
+            // propagation, when every incoming pointer has been reached
+            if (!bounds.contains(PN)) {
+              bounds[PN] = createBoundsPhis(PN, lower->getType());
+              pointerPhis.push_back(PN);
               instructionsAdded += 2;
-              lowerPhi->setOperand(0, lower);
-              sizePhi->setOperand(0, size);
-              bounds[Inst] = {lowerPhi, sizePhi};
-              bfs.emplace_back(Inst);
+              bfs.emplace_back(PN);
             }
           } else {
             // one potential path, just forward it
@@ -223,6 +3257,7 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
                                      saved_size, "load_size", LI);
                     instructionsAdded += 2;
                     bounds[LI] = {reload_lower, reload_size};
+                    slotReloads.append({reload_lower, reload_size});
                     bfs.emplace_back(LI);
                   }
                 }
@@ -231,6 +3266,11 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
                   dbgs() << "how did we get here? " << *SI << "\n";
               }
             } else if (auto CI = dyn_cast<CallInst>(Inst)) {
+              // shadow lookups take the raw address
+              if (auto *Callee = CI->getCalledFunction();
+                  Callee && (Callee->getName() == ShadowEntryName ||
+                             keepsPlainPointers(*Callee)))
+                continue;
               for (size_t i = 0; i < CI->arg_size(); ++i) {
                 auto param = CI->getArgOperand(i);
                 if (auto I = dyn_cast<Instruction>(param)) {
@@ -249,14 +3289,14 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
                           ptr_type, new_param,
                           {Constant::getIntegerValue(index_type, APInt(32, 0))},
                           "pack_ptr", CI);
-                      ourStores.insert(new StoreInst(I, addr, CI));
+                      packStores.push_back(new StoreInst(I, addr, CI));
                     }
                     {
                       auto addr = GetElementPtrInst::Create(
                           ptr_type, new_param,
                           {Constant::getIntegerValue(index_type, APInt(32, 1))},
                           "pack_lower", CI);
-                      ourStores.insert(
+                      packStores.push_back(
                           new StoreInst(bounds[I].lower, addr, CI));
                     }
                     {
@@ -264,10 +3304,22 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
                           size_type, new_param,
                           {Constant::getIntegerValue(index_type, APInt(32, 2))},
                           "pack_size", CI);
-                      ourStores.insert(new StoreInst(bounds[I].size, addr, CI));
+                      packStores.push_back(
+                          new StoreInst(bounds[I].size, addr, CI));
                     }
+                    ourStores.insert(packStores.end() - 3, packStores.end());
                     instructionsAdded += 6;
                     CI->setArgOperand(i, new_param);
+                    // an instrumented callee only loads the fat pointers
+                    // it receives as fixed parameters
+                    if (auto *Callee = CI->getCalledFunction();
+                        Callee && !Callee->isDeclaration() &&
+                        i < Callee->arg_size() &&
+                        !Callee->hasFnAttribute(UncheckedAttr) &&
+                        !is_contained(ownFunctions, Callee->getName())) {
+                      CI->addParamAttr(i, Attribute::NoCapture);
+                      CI->addParamAttr(i, Attribute::ReadOnly);
+                    }
                   }
                 }
               }
@@ -284,64 +3336,594 @@ struct VaporeonPass : public PassInfoMixin<VaporeonPass> {
       }
     }
 
+    SmallVector<WeakVH, 8> boundsPhis;
+    if (!pointerPhis.empty()) {
+      int kept = resolveBoundsPhis(pointerPhis, bounds);
+      for (auto *PN : pointerPhis)
+        for (Value *V : {bounds[PN].lower, bounds[PN].size})
+          if (isa<PHINode>(V) && !is_contained(boundsPhis, V))
+            boundsPhis.push_back(V);
+      instructionsAdded -= 2 * pointerPhis.size() - kept;
+      if (PRINTDEBUG)
+        dbgs() << kept << " of " << 2 * pointerPhis.size()
+               << " bounds phis needed\n";
+    }
+
+    // shadow stored pointers once propagation has found their bounds
+    for (auto *SI : shadowedStores) {
+      auto it = bounds.find(SI->getValueOperand());
+      auto shadowStores =
+          emitShadowStore(SI, it == bounds.end() ? nullptr : &it->second);
+      ourStores.insert(shadowStores.begin(), shadowStores.end());
+      // the call, a GEP per store, and the fence between clear and publish
+      instructionsAdded +=
+          1 + 2 * shadowStores.size() + (shadowStores.size() > 1);
+    }
+    if (PRINTDEBUG && Options.ShadowBounds)
+      dbgs() << shadowedLoads.size() << " pointer loads and "
+             << shadowedStores.size() << " pointer stores shadowed\n";
+
+    // released after propagation so the frees are not handed fat pointers
+    for (auto *buffer : guardedRoots)
+      releaseGuardedBuffer(buffer);
+    instructionsAdded += guardedRoots.size();
+
     // Step 3: create trap blockstepbro
     auto *trapBlock =
         BasicBlock::Create(F.getContext(), "helpimtrappedandcantgetout", &F);
-    CallInst::Create(Intrinsic::getDeclaration(F.getParent(), Intrinsic::trap),
-                     {}, "", trapBlock);
-
-    if (F.getReturnType()->getTypeID() == Type::VoidTyID)
-      ReturnInst::Create(F.getContext(), nullptr, trapBlock);
-    else
+    if (Options.WidenableGuards) {
+      // a failed widenable guard must leave the function by deoptimizing
+      auto *deoptimize = CallInst::Create(
+          Intrinsic::getDeclaration(F.getParent(),
+                                    Intrinsic::experimental_deoptimize,
+                                    {F.getReturnType()}),
+          {}, {OperandBundleDef("deopt", ArrayRef<Value *>())}, "", trapBlock);
       ReturnInst::Create(F.getContext(),
-                         Constant::getNullValue(F.getReturnType()), trapBlock);
+                         F.getReturnType()->isVoidTy() ? nullptr : deoptimize,
+                         trapBlock);
+      getOrDefineDeoptimizeTrap(*F.getParent());
+    } else {
+      // every check site branches here with its site ID
+      auto *site = PHINode::Create(Type::getInt32Ty(F.getContext()), 0,
+                                   "site", trapBlock);
+      CallInst::Create(getOrDefineTrapStub(*F.getParent()), {site}, "",
+                       trapBlock)
+          ->setDoesNotReturn();
+      if (Options.Fuzz)
+        lowerTrapStubForFuzzer(*F.getParent());
+      new UnreachableInst(F.getContext(), trapBlock);
+    }
     instructionsAdded += 2;
 
-    // Step 4: bounds check on writes
+    // Step 4: collect bounds checks on writes, resolving constant offsets
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    std::vector<BoundsCheck> checks;
+    std::vector<BoundsCheck> alwaysTraps;
+    int staticallyProven = 0;
+    LazyValueInfo *LVI = nullptr;
+    ScalarEvolution *SE = nullptr;
+    if (Options.ValueRanges) {
+      LVI = &FAM.getResult<LazyValueAnalysis>(F);
+      SE = &FAM.getResult<ScalarEvolutionAnalysis>(F);
+    }
+    std::vector<Guard> guards;
+    int summarizedCalls = 0, coveredBySummaries = 0, coveredByGuardPages = 0;
     for (auto &BB : F) {
       for (auto &I : BB) {
+        // check a call against its callee's summary once, then call the
+        // clone that skips the checks it covers
+        if (auto It = Summaries.calls.find(dyn_cast<CallBase>(&I));
+            It != Summaries.calls.end()) {
+          SmallVector<std::pair<Value *, Value *>, 2> toCheck;
+          bool checkable = true;
+          for (auto [ptr, extent] : It->second.args) {
+            if (Value *raw = unpacked.lookup(ptr))
+              ptr = raw;
+            if (exemptRoots.contains(getUnderlyingObject(ptr)))
+              continue;
+            checkable &= bounds.contains(ptr);
+            toCheck.push_back({ptr, extent});
+          }
+          if (!checkable)
+            continue;
+          Value *cond = nullptr;
+          for (auto [ptr, extent] : toCheck) {
+            auto *outOfBounds =
+                emitExtentOutOfBounds(ptr, extent, bounds[ptr], &I);
+            cond = cond ? BinaryOperator::CreateOr(cond, outOfBounds, "", &I)
+                        : outOfBounds;
+            instructionsAdded += 10;
+          }
+          if (cond)
+            guards.push_back({cond, &I, I.getDebugLoc()});
+          cast<CallBase>(I).setCalledFunction(It->second.Clone);
+          ++summarizedCalls;
+          continue;
+        }
         if (auto *SI = dyn_cast<StoreInst>(&I)) {
           if (ourStores.contains(SI))
             continue;
           auto *ptr = SI->getPointerOperand();
           if (!bounds.contains(ptr))
             continue;
+          if (exemptRoots.contains(getUnderlyingObject(ptr))) {
+            ++coveredBySummaries;
+            continue;
+          }
+          if (is_contained(guardedRoots, getUnderlyingObject(ptr))) {
+            ++coveredByGuardPages;
+            continue;
+          }
           if (PRINTDEBUG)
             dbgs() << "Found Store " << *SI << "\n";
           if (PRINTDEBUG)
             dbgs() << "ptr = " << *ptr << "\n";
-          auto [lower, size] = bounds.lookup(ptr);
-          if (PRINTDEBUG)
-            dbgs() << "bounds = " << *lower << " " << *size << "\n";
-
-          // if ptr - lower >= size, trap
-          auto *ptrInt =
-              new PtrToIntInst(ptr, Type::getInt64Ty(F.getContext()), "", SI);
-          auto *lowerInt =
-              new PtrToIntInst(lower, Type::getInt64Ty(F.getContext()), "", SI);
-          auto *diff = BinaryOperator::Create(Instruction::Sub, ptrInt,
-                                              lowerInt, "", SI);
-          auto *cmp = new ICmpInst(SI, ICmpInst::ICMP_UGE, diff, size);
-          // split BB
-          auto *new_origBB = BB.splitBasicBlockBefore(SI, "");
+          BoundsCheck C = {SI, ptr, bounds.lookup(ptr)};
           if (PRINTDEBUG)
-            dbgs() << "AFTER SPLITTING"
+            dbgs() << "bounds = " << *C.bounds.lower << " " << *C.bounds.size
                    << "\n";
-          if (PRINTDEBUG)
-            dbgs() << F << "\n";
-          auto *new_orig_target = new_origBB->getSingleSuccessor();
-          auto *br = BranchInst::Create(trapBlock, new_orig_target, cmp);
-          ReplaceInstWithInst(new_origBB->getTerminator(), br);
-          instructionsAdded += 5;
+          auto result = Options.StaticChecks ? evaluateStatically(C, DL)
+                                             : StaticResult::Unknown;
+          if (result == StaticResult::Unknown && LVI &&
+              provenByValueRanges(C, DL, *LVI, *SE))
+            result = StaticResult::InBounds;
+          if (result == StaticResult::InBounds) {
+            ++staticallyProven;
+            continue;
+          }
+          if (result == StaticResult::OutOfBounds) {
+            F.getContext().diagnose(
+                DiagnosticInfoAlwaysTraps(F, SI->getDebugLoc()));
+            alwaysTraps.push_back(C);
+            continue;
+          }
+          checks.push_back(C);
         }
       }
     }
+    if (PRINTDEBUG && (Options.StaticChecks || Options.ValueRanges))
+      dbgs() << staticallyProven << " checks proven in bounds statically\n";
+    if (PRINTDEBUG && Options.GuardPageThreshold)
+      dbgs() << coveredByGuardPages << " checks left to guard pages\n";
+    if (PRINTDEBUG && Options.Interprocedural)
+      dbgs() << summarizedCalls << " calls checked against callee summaries, "
+             << coveredBySummaries << " checks left to callers\n";
 
-    dbgs() << instructionsAdded << " instructions added\n";
+    // a masked store does not trap, so it cannot vouch for the stores it
+    // dominates
+    bool mask = Options.MaskIndices || hasAnnotation(F, MaskAnnotation);
+
+    // Step 5: drop checks implied by a dominating check, remembering which
+    // checks they rely on
+    MapVector<StoreInst *, std::pair<StoreInst *, StoreInst *>> coveredBy;
+    if (Options.DominatedChecks && !mask) {
+      auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      size_t before = checks.size();
+      checks = eliminateDominatedChecks(checks, DT, DL, coveredBy);
+      if (PRINTDEBUG)
+        dbgs() << before - checks.size() << " dominated checks removed\n";
+    }
+
+    // Step 6: hoist checks on affine loop accesses into the preheader
+    if (Options.LoopHoist) {
+      auto &LI = FAM.getResult<LoopAnalysis>(F);
+      auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+      auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "vaporeon");
+      MapVector<Loop *, SmallVector<Value *, 4>> preheaderChecks;
+      // a loop's hoisted checks are reported as its first hoisted store
+      DenseMap<Loop *, DebugLoc> hoistedFrom;
+      int hoisted = 0;
+      std::vector<BoundsCheck> remaining;
+      for (auto &C : checks) {
+        auto *L = LI.getLoopFor(C.SI->getParent());
+        Value *cond = L ? hoistLoopCheck(C, L, SE, DT, Expander) : nullptr;
+        if (!cond) {
+          remaining.push_back(C);
+          continue;
+        }
+        if (PRINTDEBUG)
+          dbgs() << "Hoisted check for " << *C.SI << " to "
+                 << L->getLoopPreheader()->getName() << "\n";
+        preheaderChecks[L].push_back(cond);
+        hoistedFrom.try_emplace(L, C.SI->getDebugLoc());
+        ++hoisted;
+      }
+      // stores hoisted out of the same loop share one branch
+      for (auto &[L, conds] : preheaderChecks) {
+        auto *InsertPt = L->getLoopPreheader()->getTerminator();
+        Value *cond = conds.front();
+        for (auto *other : drop_begin(conds))
+          cond = BinaryOperator::CreateOr(cond, other, "", InsertPt);
+        guards.push_back({cond, InsertPt, hoistedFrom.lookup(L)});
+        instructionsAdded += 11 * conds.size() + 1;
+      }
+      checks = std::move(remaining);
+      if (PRINTDEBUG)
+        dbgs() << hoisted << " loop checks hoisted to preheaders\n";
+    }
+
+    // Step 7: version loops whose trip count is only known at runtime
+    if (Options.LoopVersion) {
+      auto &LI = FAM.getResult<LoopAnalysis>(F);
+      auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+      auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "vaporeon");
+      int versioned = 0;
+      for (auto *L : LI.getLoopsInPreorder()) {
+        std::vector<BoundsCheck> loopChecks, otherChecks;
+        for (auto &C : checks)
+          (L->contains(C.SI) ? loopChecks : otherChecks).push_back(C);
+        if (loopChecks.empty() ||
+            !versionLoop(L, loopChecks, otherChecks, LI, SE, DT, Expander,
+                         guards, instructionsAdded))
+          continue;
+        if (PRINTDEBUG)
+          dbgs() << "Versioned loop " << L->getHeader()->getName() << "\n";
+        ++versioned;
+      }
+      if (PRINTDEBUG)
+        dbgs() << versioned << " loops versioned\n";
+    }
+
+    // Step 8: reduce checks on pointer induction variables to one compare
+    if (Options.StrengthReduce) {
+      auto &LI = FAM.getResult<LoopAnalysis>(F);
+      auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+      auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "vaporeon");
+      int reduced = 0;
+      for (auto &C : checks) {
+        auto *L = LI.getLoopFor(C.SI->getParent());
+        if (!L || !(C.limit = strengthReduceCheck(C, L, SE, DT, Expander)))
+          continue;
+        instructionsAdded += 4;
+        ++reduced;
+      }
+      if (PRINTDEBUG)
+        dbgs() << reduced << " induction variable checks strength-reduced\n";
+    }
 
-    return PreservedAnalyses::all();
+    // Step 9: move checks to colder blocks and apply the overhead budget
+    if (Options.CheckMotion || Options.Budget) {
+      auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+      auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
+      auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+      auto &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+      auto placement = [](const BoundsCheck &C) {
+        return C.insertPt ? C.insertPt : C.SI;
+      };
+
+      int moved = 0;
+      for (auto &C : checks) {
+        if (!Options.CheckMotion)
+          break;
+        auto *P = findColderPlacement(C, DT, PDT, BFI);
+        if (!P)
+          continue;
+        C.insertPt = P;
+        ORE.emit([&] {
+          return OptimizationRemark("vaporeon", "CheckMoved", C.SI)
+                 << "bounds check moved to colder block "
+                 << ore::NV("Block", C.insertPt->getParent()->getName());
+        });
+        ++moved;
+      }
+
+      // keep the coldest checks until the expected number run per call
+      // exceeds the budget
+      int dropped = 0;
+      if (Options.Budget) {
+        double entryFreq = BFI.getEntryFreq();
+        auto cost = [&](const BoundsCheck &C) {
+          return BFI.getBlockFreq(placement(C)->getParent()).getFrequency() /
+                 entryFreq;
+        };
+        std::stable_sort(checks.begin(), checks.end(),
+                         [&](const BoundsCheck &A, const BoundsCheck &B) {
+                           return cost(A) < cost(B);
+                         });
+        double spent = 0;
+        std::vector<BoundsCheck> kept;
+        DenseSet<StoreInst *> droppedStores;
+        for (auto &C : checks) {
+          spent += cost(C);
+          if (spent <= Options.Budget) {
+            kept.push_back(C);
+            continue;
+          }
+          ORE.emit([&] {
+            return OptimizationRemarkMissed("vaporeon", "CheckDropped", C.SI)
+                   << "bounds check dropped, expected executions per call "
+                   << ore::NV("Cost", formatv("{0:f2}", cost(C)).str())
+                   << " exceed the budget";
+          });
+          ++dropped;
+          droppedStores.insert(C.SI);
+        }
+        checks = std::move(kept);
+        // the checks a dropped check vouched for go with it
+        for (auto &[SI, by] : coveredBy) {
+          if (!droppedStores.contains(by.first) &&
+              !droppedStores.contains(by.second))
+            continue;
+          ORE.emit([&] {
+            return OptimizationRemarkMissed("vaporeon", "CheckDropped", SI)
+                   << "bounds check dropped with the dominating check it "
+                      "relied on";
+          });
+          ++dropped;
+        }
+      }
+      if (PRINTDEBUG)
+        dbgs() << moved << " checks moved to colder blocks, " << dropped
+               << " dropped over budget\n";
+    }
+
+    // Step 10: merge checks off the same base within each basic block
+    if (Options.Coalesce) {
+      size_t before = checks.size();
+      size_t guardsBefore = guards.size();
+      checks = coalesceBlockChecks(checks, DL, guards, instructionsAdded);
+      if (PRINTDEBUG)
+        dbgs() << before - checks.size() << " checks coalesced into "
+               << guards.size() - guardsBefore << "\n";
+    }
+
+    // Step 11: emit checks, numbering trap sites after those of functions
+    // already instrumented
+    unsigned firstSite = numTrapSites(*F.getParent());
+    SmallVector<DebugLoc, 16> sites;
+    bool audit = Options.Audit && !Options.WidenableGuards;
+    std::optional<AuditState> auditState;
+    int audited = 0;
+    // every condition gets its own branch, all to the same site
+    auto emitCheck = [&](ArrayRef<Value *> conds, Instruction *InsertPt,
+                         DebugLoc Loc) {
+      if (Options.WidenableGuards) {
+        for (auto *cond : conds)
+          emitWidenableBranch(cond, InsertPt, trapBlock);
+        instructionsAdded += 2 * conds.size();
+        return;
+      }
+      unsigned siteID = firstSite + sites.size();
+      sites.push_back(Loc);
+      auto *CheckPt = InsertPt;
+      if (Options.SamplePeriod > 1) {
+        if (Options.SampleSites)
+          CheckPt = emitSampleBranch(InsertPt, Options.SamplePeriod);
+        emitSampleCount(siteID, CheckPt);
+      }
+      if (Options.Fuzz)
+        emitCoverageCount(siteID, CheckPt);
+      if (audit) {
+        if (!auditState)
+          auditState = createAuditState(F);
+        for (auto *cond : conds)
+          emitAuditUpdate(cond, CheckPt, *auditState, siteID);
+        instructionsAdded += 5 * conds.size();
+        ++audited;
+        return;
+      }
+      for (auto *cond : conds)
+        emitTrapBranch(cond, CheckPt, trapBlock, siteID);
+    };
+    // decide which checks to outline and where end pointers go before
+    // splitting blocks, while every block still has a frequency
+    std::vector<bool> outline(checks.size());
+    int outlined = 0;
+    if (Options.OutlineChecks && !Options.WidenableGuards && !mask &&
+        !audit) {
+      auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+      double entryFreq = BFI.getEntryFreq();
+      for (auto [C, outlineC] : zip(checks, outline)) {
+        auto *BB = (C.insertPt ? C.insertPt : C.SI)->getParent();
+        outlineC = F.hasOptSize() ||
+                   BFI.getBlockFreq(BB).getFrequency() / entryFreq <
+                       Options.OutlineHotness;
+      }
+    }
+    DenseMap<std::pair<Value *, Value *>, Value *> ends;
+    if (Options.Encoding == CheckEncoding::EndPointer && !mask) {
+      DominatorTree DT(F);
+      for (auto [C, outlineC] : zip(checks, outline)) {
+        auto &end = ends[{C.bounds.lower, C.bounds.size}];
+        if (!C.limit && !outlineC && !end) {
+          end = emitEndPointer(C.bounds, F, DT);
+          instructionsAdded += 1;
+        }
+      }
+    }
+    for (auto &G : guards)
+      emitCheck(G.cond, G.insertPt, G.loc);
+    for (auto &C : alwaysTraps) {
+      emitCheck(ConstantInt::getTrue(F.getContext()), C.SI,
+                C.SI->getDebugLoc());
+      instructionsAdded += 1;
+    }
+    int masked = 0;
+    for (auto [C, outlineC] : zip(checks, outline)) {
+      auto *InsertPt = C.insertPt ? C.insertPt : C.SI;
+      if (mask) {
+        C.SI->setOperand(StoreInst::getPointerOperandIndex(),
+                         emitMaskedPointer(C, DL));
+        instructionsAdded += 5;
+        ++masked;
+        continue;
+      }
+      if (outlineC) {
+        auto *Int32Ty = Type::getInt32Ty(F.getContext());
+        auto *site = ConstantInt::get(Int32Ty, firstSite + sites.size());
+        sites.push_back(C.SI->getDebugLoc());
+        auto *thunk = getOrDefineCheckThunk(*F.getParent(), C.limit);
+        SmallVector<Value *, 4> args = {C.ptr};
+        if (C.limit)
+          args.push_back(C.limit);
+        else
+          args.append({C.bounds.lower, C.bounds.size});
+        args.push_back(site);
+        if (Options.SamplePeriod > 1 && !Options.SampleSites)
+          emitSampleCount(site->getZExtValue(), InsertPt);
+        if (Options.Fuzz)
+          emitCoverageCount(site->getZExtValue(), InsertPt);
+        CallInst::Create(thunk, args, "", InsertPt);
+        instructionsAdded += 1;
+        ++outlined;
+        continue;
+      }
+      // if ptr - lower >= size, trap
+      SmallVector<Value *, 2> conds;
+      if (C.limit)
+        conds.push_back(
+            new ICmpInst(InsertPt, ICmpInst::ICMP_UGE, C.ptr, C.limit));
+      else
+        conds = emitEncodedOutOfBounds(
+            C, Options.Encoding,
+            ends.lookup({C.bounds.lower, C.bounds.size}), DL, InsertPt);
+      // split BB
+      emitCheck(conds, InsertPt, C.SI->getDebugLoc());
+      if (PRINTDEBUG)
+        dbgs() << "AFTER SPLITTING"
+               << "\n";
+      if (PRINTDEBUG)
+        dbgs() << F << "\n";
+      instructionsAdded += 5;
+    }
+
+    if (PRINTDEBUG && Options.OutlineChecks)
+      dbgs() << outlined << " checks outlined\n";
+    if (PRINTDEBUG && mask)
+      dbgs() << masked << " stores masked into bounds\n";
+    if (auditState) {
+      emitAuditExaminations(F, *auditState, ownFunctions);
+      if (PRINTDEBUG)
+        dbgs() << audited << " checks deferred to audit points\n";
+    }
+    if (!sites.empty())
+      addTrapSites(F, sites);
+    if (Options.SamplePeriod > 1 && !sites.empty())
+      defineSampleReport(*F.getParent());
+    if (Options.Fuzz && !sites.empty())
+      defineCoverage(F, sites.size());
+
+    // Keep the bounds of pointer locals in registers. Only this pass loads
+    // and stores the loc_lower and loc_size slots, so they can be promoted
+    // even when the local they shadow escapes, and a pointer copied around a
+    // loop no longer costs two extra loads and stores per copy.
+    // Unused reloads would make promotion place phis for them.
+    int unusedBounds = 0;
+    if (Options.LazyBounds)
+      for (auto &V : slotReloads)
+        if (auto *LI = cast_or_null<LoadInst>(V); LI && LI->use_empty()) {
+          LI->eraseFromParent();
+          ++unusedBounds;
+        }
+    erase_if(boundsSlots,
+             [](AllocaInst *AI) { return !isAllocaPromotable(AI); });
+    DominatorTree DT(F);
+    if (!boundsSlots.empty()) {
+      PromoteMemToReg(boundsSlots, DT);
+      if (PRINTDEBUG)
+        dbgs() << boundsSlots.size() / 2
+               << " local pointer bounds promoted to registers\n";
+    }
+
+    // Materialize bounds on demand: drop the phis and incoming bounds no
+    // check, call or phi uses, and load the rest as late as possible.
+    LoopInfo LI(DT);
+    if (Options.LazyBounds) {
+      for (auto &V : boundsPhis)
+        if (auto *PN = cast_or_null<PHINode>(V))
+          unusedBounds += RecursivelyDeleteDeadPHINode(PN);
+      // the selects come before their lookup's call, which goes last
+      // a lookup's atomic loads and fence are not trivially dead, so a lookup
+      // whose selects go unused is erased whole
+      for (auto &Lookup : shadowLookups) {
+        if (!all_of(drop_begin(Lookup, Lookup.size() - 2), [](WeakVH &V) {
+              return V && cast<Instruction>(V)->use_empty();
+            }))
+          continue;
+        for (auto &V : reverse(Lookup))
+          if (auto *I = cast_or_null<Instruction>(V))
+            I->eraseFromParent();
+        // counted below as one unused bound
+        instructionsAdded -= Lookup.size() - 1;
+        ++unusedBounds;
+      }
+      int sunk = 0;
+      for (auto *Load : paramBounds) {
+        auto *Addr = cast<Instruction>(Load->getPointerOperand());
+        if (Load->use_empty()) {
+          Load->eraseFromParent();
+          Addr->eraseFromParent();
+          ++unusedBounds;
+          continue;
+        }
+        auto *InsertPt = findLatePlacement(Load, DT, LI);
+        if (InsertPt->getParent() != Load->getParent())
+          ++sunk;
+        Addr->moveBefore(InsertPt);
+        Load->moveBefore(InsertPt);
+      }
+      instructionsAdded -= unusedBounds;
+      if (PRINTDEBUG)
+        dbgs() << unusedBounds << " unused bounds removed, " << sunk
+               << " incoming bounds loaded late\n";
+    }
+
+    // Store loop-invariant fat pointers for calls in a loop once, before it.
+    if (Options.ForwardBounds && !packStores.empty()) {
+      auto &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+      BasicAAResult BasicAA(DL, F, TLI, FAM.getResult<AssumptionAnalysis>(F),
+                            &DT);
+      AAResults AA(TLI);
+      AA.addAAResult(BasicAA);
+      MemorySSA MSSA(F, &AA, &DT);
+      int hoisted = hoistPackStores(packStores, MSSA, AA, LI);
+      if (PRINTDEBUG)
+        dbgs() << hoisted << " fat pointer stores hoisted out of loops\n";
+    }
+
+    // Step 12: run an unchecked clone while checks are disabled at runtime
+    // or the call is not sampled. musttail cannot forward to a clone of a
+    // varargs function portably.
+    bool sampleCalls = Options.SamplePeriod > 1 && !Options.SampleSites;
+    if ((Options.RuntimeToggle || sampleCalls) && !F.isVarArg() &&
+        (!pred_empty(trapBlock) || outlined || audited)) {
+      auto *Clone =
+          addUncheckedClone(F, trapBlock, Options.RuntimeToggle,
+                            sampleCalls ? Options.SamplePeriod : 0);
+      if (PRINTDEBUG)
+        dbgs() << "checks of " << F.getName() << " can be skipped through "
+               << Clone->getName() << "\n";
+    }
+    if (pred_empty(trapBlock))
+      trapBlock->eraseFromParent();
+
+    dbgs() << instructionsAdded << " instructions added\n";
   }
 };
+
+// Parses `vaporeonpass` or `vaporeonpass<...>`; returns std::nullopt if Name
+// is another pass and prints the error for bad parameters. Both pipeline
+// callbacks parse every name they see, so each error is printed only once.
+std::optional<VaporeonOptions> parseVaporeonPassName(StringRef Name) {
+  static StringSet<> reported;
+  StringRef Params = Name;
+  if (!Params.consume_front("vaporeonpass"))
+    return std::nullopt;
+  if (!Params.empty() &&
+      !(Params.consume_front("<") && Params.consume_back(">")))
+    return std::nullopt;
+  auto Options = parseVaporeonOptions(Params);
+  if (!Options) {
+    std::string Err = toString(Options.takeError());
+    if (reported.insert(Name).second)
+      errs() << Err << "\n";
+    return std::nullopt;
+  }
+  return *Options;
+}
 } // namespace
 
 extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
@@ -350,11 +3932,25 @@ llvmGetPassPluginInfo() {
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, FunctionPassManager &FPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
-                  if (Name == "vaporeonpass") {
-                    FPM.addPass(VaporeonPass());
-                    return true;
+                  auto Options = parseVaporeonPassName(Name);
+                  if (!Options)
+                    return false;
+                  if (Options->Interprocedural) {
+                    errs() << "vaporeonpass<interprocedural> must run as a "
+                              "module pass\n";
+                    return false;
                   }
-                  return false;
+                  FPM.addPass(VaporeonPass(*Options));
+                  return true;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  auto Options = parseVaporeonPassName(Name);
+                  if (!Options)
+                    return false;
+                  MPM.addPass(VaporeonPass(*Options));
+                  return true;
                 });
           }};
-}
\ No newline at end of file
+}